@@ -0,0 +1,165 @@
+// Synthetic data shared by the benchmarks, and a minimal harness to time
+// them.
+#![allow(dead_code)]
+
+use std::env;
+use std::time::{Duration, Instant};
+
+use rand::rngs::StdRng;
+use rand::{Rng, SeedableRng};
+
+use rbperf::id_cache::{make_id, IdCache};
+use rbperf::{ruby_stack_status_STACK_COMPLETE, RubyFrame, RubyStack, COMM_MAXLEN, MAX_STACK};
+
+pub struct Workload {
+    pub frames: IdCache<RubyFrame>,
+    pub strings: IdCache<String>,
+    pub stacks: Vec<RubyStack>,
+}
+
+// Frames and strings are spread over this many CPUs, as BPF allocates
+// their ids from per-CPU counters.
+const CPUS: usize = 8;
+// Every request goes through the same server, middleware and router
+// frames before reaching the application.
+const COMMON_PREFIX: usize = 60;
+// Distinct stacks below the common prefix, most samples hit a few of them.
+const STACK_SHAPES: usize = 500;
+
+/// Stacks shaped like the ones from a Rails application: deep, sharing a
+/// long common prefix, and with a few hot code paths accounting for most
+/// of the samples.
+pub fn rails_workload(stacks: usize, unique_frames: u32) -> Workload {
+    let mut rng = StdRng::seed_from_u64(42);
+    let mut frames = IdCache::new();
+    let mut strings = IdCache::new();
+    let mut frame_ids = Vec::with_capacity(unique_frames as usize);
+
+    for i in 0..unique_frames {
+        let cpu = i as usize % CPUS;
+        let index = i / CPUS as u32 + 1;
+        let method_name_id = make_id(cpu, 2 * index - 1);
+        let path_id = make_id(cpu, 2 * index);
+        strings.insert(
+            method_name_id,
+            format!("ActiveSupport::Callbacks::CallbackChain#method_{}", i),
+        );
+        strings.insert(
+            path_id,
+            format!(
+                "/app/vendor/bundle/ruby/3.1.0/gems/gem_{}-1.0.0/lib/gem/file_{}.rb",
+                i % 200,
+                i % 5000
+            ),
+        );
+        let id = make_id(cpu, index);
+        frames.insert(
+            id,
+            RubyFrame {
+                lineno: rng.gen_range(1..2000),
+                method_name_id,
+                path_id,
+            },
+        );
+        frame_ids.push(id);
+    }
+
+    let prefix: Vec<u32> = frame_ids[..COMMON_PREFIX].to_vec();
+    let shapes: Vec<Vec<u32>> = (0..STACK_SHAPES)
+        .map(|_| {
+            let depth = rng.gen_range(20..(MAX_STACK as usize - COMMON_PREFIX));
+            let mut shape = prefix.clone();
+            shape.extend((0..depth).map(|_| frame_ids[rng.gen_range(0..frame_ids.len())]));
+            shape
+        })
+        .collect();
+
+    let mut comm = [0; COMM_MAXLEN as usize];
+    for (i, c) in b"puma: cluster worker".iter().enumerate() {
+        comm[i] = *c as _;
+    }
+    let stacks = (0..stacks)
+        .map(|i| {
+            // Skewed towards the first shapes
+            let shape = &shapes[(rng.gen::<f64>().powi(3) * STACK_SHAPES as f64) as usize];
+            let mut stack_frames = [0; MAX_STACK as usize];
+            // Stacks are sent leaf first
+            for (frame, id) in stack_frames.iter_mut().zip(shape.iter().rev()) {
+                *frame = *id;
+            }
+            RubyStack {
+                timestamp: i as u64,
+                weight: 1,
+                frames: stack_frames,
+                pid: 1000 + (i % 16) as u32,
+                cpu: (i % CPUS) as u32,
+                during_gc: 0,
+                id_generation: 0,
+                syscall_id: 0,
+                size: shape.len() as i64,
+                expected_size: shape.len() as i64,
+                comm,
+                stack_status: ruby_stack_status_STACK_COMPLETE,
+            }
+        })
+        .collect();
+
+    Workload {
+        frames,
+        strings,
+        stacks,
+    }
+}
+
+// Each benchmark runs for at least this long, and at least `MIN_RUNS` times.
+const MEASURE_TIME: Duration = Duration::from_secs(2);
+const MIN_RUNS: u32 = 10;
+
+/// Times `routine` on an input built by `setup`, which isn't timed, and
+/// prints the mean and fastest run. `elements` is how many items a run
+/// processes, to also print the throughput. Only the benchmarks whose name
+/// contains the first argument given to `cargo bench`, if any, run.
+pub fn bench_batched<I, O>(
+    name: &str,
+    elements: Option<u64>,
+    mut setup: impl FnMut() -> I,
+    mut routine: impl FnMut(I) -> O,
+) {
+    let filter = env::args().skip(1).find(|arg| !arg.starts_with('-'));
+    if filter.map_or(false, |filter| !name.contains(&filter)) {
+        return;
+    }
+
+    // Warm up the caches and the allocator
+    std::hint::black_box(routine(setup()));
+
+    let mut runs = 0;
+    let mut total = Duration::ZERO;
+    let mut fastest = Duration::MAX;
+    while runs < MIN_RUNS || total < MEASURE_TIME {
+        let input = setup();
+        let started_at = Instant::now();
+        std::hint::black_box(routine(input));
+        let elapsed = started_at.elapsed();
+        total += elapsed;
+        fastest = fastest.min(elapsed);
+        runs += 1;
+    }
+
+    let mean = total / runs;
+    match elements {
+        Some(elements) => println!(
+            "{:<32} mean {:>12?}  fastest {:>12?}  {:>12.0} elements/s",
+            name,
+            mean,
+            fastest,
+            elements as f64 / mean.as_secs_f64()
+        ),
+        None => println!("{:<32} mean {:>12?}  fastest {:>12?}", name, mean, fastest),
+    }
+}
+
+/// Like `bench_batched`, without an input.
+pub fn bench<O>(name: &str, elements: Option<u64>, mut routine: impl FnMut() -> O) {
+    bench_batched(name, elements, || (), |_| routine());
+}
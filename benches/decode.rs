@@ -0,0 +1,19 @@
+use rbperf::decode::Decoder;
+
+mod common;
+
+fn bench_decode() {
+    let workload = common::rails_workload(100_000, 50_000);
+    let decoder = Decoder::new(&workload.frames, &workload.strings, false);
+    let elements = Some(workload.stacks.len() as u64);
+
+    for workers in [1, 2, 4, 8] {
+        common::bench(&format!("decode/{}", workers), elements, || {
+            decoder.decode_all(&workload.stacks, workers)
+        });
+    }
+}
+
+fn main() {
+    bench_decode();
+}
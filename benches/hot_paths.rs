@@ -0,0 +1,83 @@
+use std::hint::black_box;
+
+use rbperf::decode::{DecodeStats, Decoder};
+use rbperf::profile::Profile;
+use rbperf::ruby_readers::{any_as_u8_slice, parse_stack, str_from_u8_nul};
+use rbperf::PATH_MAXLEN;
+
+mod common;
+
+const STACKS: usize = 20_000;
+const UNIQUE_FRAMES: u32 = 50_000;
+
+fn bench_parsing() {
+    let workload = common::rails_workload(1, UNIQUE_FRAMES);
+    let stack = workload.stacks[0];
+    let stack_bytes = unsafe { any_as_u8_slice(&stack) };
+    common::bench("parse_stack", None, || unsafe {
+        parse_stack(black_box(stack_bytes))
+    });
+
+    let mut path = [0u8; PATH_MAXLEN as usize];
+    let name =
+        b"/app/vendor/bundle/ruby/3.1.0/gems/actionpack-7.0.4/lib/action_controller/metal.rb";
+    path[..name.len()].copy_from_slice(name);
+    common::bench("str_from_u8_nul", None, || {
+        unsafe { str_from_u8_nul(black_box(&path)) }.unwrap().len()
+    });
+}
+
+fn bench_profile() {
+    let workload = common::rails_workload(STACKS, UNIQUE_FRAMES);
+    let decoder = Decoder::new(&workload.frames, &workload.strings, false);
+    let (profile, _) = decoder.decode_all(&workload.stacks, 1);
+
+    // The stacks as process() passes them to the profile
+    let samples: Vec<Vec<(String, String)>> = workload
+        .stacks
+        .iter()
+        .map(|stack| {
+            stack.frames[..stack.size as usize]
+                .iter()
+                .map(|id| {
+                    let frame = workload.frames.get(*id).unwrap();
+                    (
+                        workload.strings.get(frame.method_name_id).unwrap().clone(),
+                        workload.strings.get(frame.path_id).unwrap().clone(),
+                    )
+                })
+                .collect()
+        })
+        .collect();
+
+    let elements = Some(STACKS as u64);
+    common::bench_batched(
+        "profile/add_sample",
+        elements,
+        || samples.clone(),
+        |samples| {
+            let mut profile = Profile::new();
+            for sample in samples {
+                profile.add_sample(1000, "ruby".to_string(), sample);
+            }
+            profile
+        },
+    );
+    common::bench("profile/folded", elements, || profile.folded());
+    common::bench("profile/to_json", elements, || {
+        serde_json::to_string(&profile).unwrap()
+    });
+    common::bench("profile/decode", elements, || {
+        let mut profile = Profile::new();
+        let mut stats = DecodeStats::default();
+        for stack in &workload.stacks {
+            decoder.decode(stack, &mut profile, &mut stats);
+        }
+        profile
+    });
+}
+
+fn main() {
+    bench_parsing();
+    bench_profile();
+}
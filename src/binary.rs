@@ -1,4 +1,7 @@
 use anyhow::{anyhow, Result};
+use goblin::elf::program_header::PT_LOAD;
+use goblin::elf::section_header::SHN_UNDEF;
+use goblin::elf::sym::{Sym, STT_FUNC};
 use goblin::Object;
 use log::debug;
 use std::convert::TryInto;
@@ -60,6 +63,42 @@ fn address_for_symbol(bin_path: &Path, symbol: &str) -> Result<Symbol> {
     }
 }
 
+/// Offset in `bin_path` of the function named exactly `symbol`, as uprobes
+/// take it. Unlike `address_for_symbol`, parts split off by the compiler,
+/// such as `symbol.cold`, don't match, and neither do functions imported
+/// from other libraries.
+pub fn function_file_offset(bin_path: &Path, symbol: &str) -> Result<u64> {
+    // Imported functions have an undefined section and no address
+    let defined_function = |sym: &Sym| {
+        sym.st_type() == STT_FUNC && sym.st_shndx != SHN_UNDEF as usize && sym.st_value != 0
+    };
+    let buffer = fs::read(bin_path)?;
+    match Object::parse(&buffer)? {
+        Object::Elf(elf) => {
+            let address = elf
+                .syms
+                .iter()
+                .find(|sym| defined_function(sym) && &elf.strtab[sym.st_name] == symbol)
+                .or_else(|| {
+                    elf.dynsyms
+                        .iter()
+                        .find(|sym| defined_function(sym) && &elf.dynstrtab[sym.st_name] == symbol)
+                })
+                .map(|sym| sym.st_value)
+                .ok_or_else(|| anyhow!("Could not find function {} in {:?}", symbol, bin_path))?;
+
+            elf.program_headers
+                .iter()
+                .find(|header| {
+                    header.p_type == PT_LOAD && header.vm_range().contains(&(address as usize))
+                })
+                .map(|header| address - header.p_vaddr + header.p_offset)
+                .ok_or_else(|| anyhow!("{} is not in a loaded segment of {:?}", symbol, bin_path))
+        }
+        _ => Err(anyhow!("{:?} is not an ELF executable", bin_path)),
+    }
+}
+
 pub fn ruby_current_thread_address(bin_path: &Path, ruby_version: &str) -> Result<Symbol> {
     let v: Vec<i32> = ruby_version
         .split('.')
@@ -110,6 +149,16 @@ mod tests {
         assert!(address_for_symbol(Path::new("/proc/self/exe"), "main").is_ok());
     }
 
+    #[test]
+    fn test_function_file_offset() {
+        let exe = Path::new("/proc/self/exe");
+        assert!(function_file_offset(exe, "main").is_ok());
+        // Only exact names match
+        assert!(function_file_offset(exe, "mai").is_err());
+        // Imported from libc, its code isn't in this binary
+        assert!(function_file_offset(exe, "malloc").is_err());
+    }
+
     #[test]
     fn test_ruby_current_thread_does_not_exist() {
         assert!(ruby_current_thread_address(Path::new("/proc/self/exe"), "2.5.0").is_err());
@@ -19,6 +19,22 @@ struct {
     __uint(type, BPF_MAP_TYPE_RINGBUF);
 } events SEC(".maps");
 
+// Additional ring buffer shards, only used with more than one shard. Their
+// size is set in rbperf.rs, which doesn't create the unused ones.
+#define RINGBUF_SHARD(name)                  \
+    struct {                                 \
+        __uint(type, BPF_MAP_TYPE_RINGBUF);  \
+        __uint(max_entries, 4096);           \
+    } name SEC(".maps")
+
+RINGBUF_SHARD(events_1);
+RINGBUF_SHARD(events_2);
+RINGBUF_SHARD(events_3);
+RINGBUF_SHARD(events_4);
+RINGBUF_SHARD(events_5);
+RINGBUF_SHARD(events_6);
+RINGBUF_SHARD(events_7);
+
 struct {
     __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
     __uint(max_entries, 3);
@@ -33,20 +49,62 @@ struct {
     __type(value, ProcessData);
 } pid_to_rb_thread SEC(".maps");
 
+// The frame maps evict the least recently used entries once full. Their
+// size is set at load time in rbperf.rs, and userspace copies new frames
+// out of id_to_stack shortly after they are inserted.
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
     __uint(max_entries, 10240);
     __type(key, u32);
     __type(value, RubyFrame);
 } id_to_stack SEC(".maps");
 
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
     __uint(max_entries, 10240);
     __type(key, RubyFrame);
     __type(value, u32);
 } stack_to_id SEC(".maps");
 
+// Strings are interned by RubyStringKey.
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 10240);
+    __type(key, u32);
+    __type(value, RubyString);
+} id_to_string SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 10240);
+    __type(key, RubyStringKey);
+    __type(value, u32);
+} string_to_id SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, ID_COUNTER_KINDS);
+    __type(key, u32);
+    __type(value, u32);
+} id_counters SEC(".maps");
+
+// Bumped by userspace before and after it recycles the ids, which it does
+// by clearing the maps above and resetting the counters. Stacks aren't
+// walked while it's odd.
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, u32);
+} id_generation SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, STAT_COUNT);
+    __type(key, u32);
+    __type(value, u64);
+} bpf_stats SEC(".maps");
+
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
     __uint(max_entries, 10);
@@ -61,10 +119,66 @@ struct {
     __type(value, SampleState);
 } global_state SEC(".maps");
 
+// Threads waiting for the GVL, by thread id.
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 10240);
+    __type(key, u32);
+    __type(value, GvlWait);
+} gvl_waits SEC(".maps");
+
+// When the running calls to the timed function started, by thread id.
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 10240);
+    __type(key, u32);
+    __type(value, u64);
+} call_starts SEC(".maps");
+
+// The rb_thread_t running on the threads of the profiled processes, by
+// thread id, learned as they take the GVL.
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 10240);
+    __type(key, u32);
+    __type(value, u64);
+} ruby_threads SEC(".maps");
+
+// When runnable threads of the profiled processes were put in the run
+// queue, by thread id.
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 10240);
+    __type(key, u32);
+    __type(value, u64);
+} runqueue_starts SEC(".maps");
+
+// Uprobe hits since the last sampled one, by CPU.
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, u32);
+    __type(value, u64);
+} uprobe_hit_counts SEC(".maps");
+
 const volatile bool verbose = false;
 const volatile bool use_ringbuf = false;
+// When non-zero, ring buffer samples are submitted without waking up the
+// consumer until at least this many bytes are pending.
+const volatile u64 ringbuf_wakeup_threshold = 0;
+const volatile u32 ringbuf_shards = 1;
 const volatile bool enable_pid_race_detector = true;
 const volatile enum rbperf_event_type event_type = RBPERF_EVENT_SYSCALL_UNKNOWN;
+// Shorter GVL waits aren't sampled, most acquisitions don't wait at all.
+const volatile u64 gvl_min_wait_ns = 0;
+// Shorter run queue delays aren't sampled.
+const volatile u64 runqueue_min_delay_ns = 0;
+// Only one in every this many uprobe hits is sampled.
+const volatile u64 uprobe_sample_every = 1;
+// Syscall samples are weighted by the argument at this index, or by the
+// return value with 0 in sys_exit tracepoints. Otherwise, with -1, they
+// count calls.
+const volatile int syscall_weight_field = -1;
 
 #define LOG(fmt, ...)                       \
     ({                                      \
@@ -73,43 +187,175 @@ const volatile enum rbperf_event_type event_type = RBPERF_EVENT_SYSCALL_UNKNOWN;
         }                                   \
     })
 
+static inline_method void bump_stat(u32 stat) {
+    u64 *count = bpf_map_lookup_elem(&bpf_stats, &stat);
+    if (count != NULL) {
+        *count += 1;
+    }
+}
+
+static inline_method u32 current_id_generation() {
+    u32 zero = 0;
+    u32 *generation = bpf_map_lookup_elem(&id_generation, &zero);
+    return generation == NULL ? 0 : *generation;
+}
+
+static inline_method void *ringbuf_shard(u32 shard) {
+    // Lets the verifier skip the shards that weren't created
+    if (shard >= ringbuf_shards) {
+        return &events;
+    }
+    switch (shard) {
+    case 1:
+        return &events_1;
+    case 2:
+        return &events_2;
+    case 3:
+        return &events_3;
+    case 4:
+        return &events_4;
+    case 5:
+        return &events_5;
+    case 6:
+        return &events_6;
+    case 7:
+        return &events_7;
+    default:
+        return &events;
+    }
+}
+
 static inline_method int read_syscall_id(void *ctx, int *syscall_id) {
     return bpf_probe_read_kernel(syscall_id, SYSCALL_NR_SIZE, ctx + SYSCALL_NR_OFFSET);
 }
 
+// Stores `value` under a new id in `id_to_value`, and the id under `key`
+// in `key_to_id`. Returns the id, or zero if it could not be stored.
+static inline_method u32 insert_with_new_id(void *key_to_id, void *id_to_value,
+                                            u32 counter_kind, void *key, void *value) {
+    u32 *counter = bpf_map_lookup_elem(&id_counters, &counter_kind);
+    if (counter == NULL) {
+        bump_stat(STAT_ID_INSERT_ERRORS);
+        return 0;  // this should never happen
+    }
+
+    u32 next = *counter + 1;
+    if (next > ID_COUNTER_MASK) {
+        // Every id of this CPU was handed out. Reusing one would make the
+        // stacks that already refer to it resolve to the new value.
+        bump_stat(STAT_IDS_EXHAUSTED_ERRORS);
+        return 0;
+    }
+    u32 id = (bpf_get_smp_processor_id() << ID_CPU_SHIFT) | next;
+
+    // Store the value before its id can be found in `key_to_id`, so an id
+    // handed out to other CPUs can always be resolved.
+    if (bpf_map_update_elem(id_to_value, &id, value, BPF_ANY) != 0) {
+        LOG("[error] could not insert id %d", id);
+        bump_stat(STAT_ID_INSERT_ERRORS);
+        return 0;
+    }
+
+    if (bpf_map_update_elem(key_to_id, key, &id, BPF_NOEXIST) != 0) {
+        // Either another CPU inserted this key concurrently, in which case
+        // we use its id, or the map is full.
+        bpf_map_delete_elem(id_to_value, &id);
+        u32 *found_id = bpf_map_lookup_elem(key_to_id, key);
+        if (found_id == NULL) {
+            bump_stat(STAT_ID_INSERT_ERRORS);
+            return 0;
+        }
+        return *found_id;
+    }
+
+    // Only consume the id once it has been published, so userspace can
+    // read every id up to the counter value.
+    *counter = next;
+    return id;
+}
+
 static inline_method u32 find_or_insert_frame(RubyFrame *frame) {
     u32 *found_id = bpf_map_lookup_elem(&stack_to_id, frame);
     if (found_id != NULL) {
         return *found_id;
     }
-    // TODO(javierhonduco): Instead of calling the random number generator
-    // we could generate unique IDs per CPU.
-    u32 random = bpf_get_prandom_u32();
-    bpf_map_update_elem(&stack_to_id, frame, &random, BPF_ANY);
-    bpf_map_update_elem(&id_to_stack, &random, frame, BPF_ANY);
-    return random;
+    return insert_with_new_id(&stack_to_id, &id_to_stack, FRAME_ID_COUNTER, frame, frame);
 }
 
-static inline_method void read_ruby_string(u64 label, char *buffer,
-                                           int buffer_len) {
+static inline_method int read_ruby_string(u64 label, char *buffer,
+                                          int buffer_len) {
     u64 flags;
     u64 char_ptr;
+    int err;
 
     rbperf_read(&flags, 8, (void *)(label + 0 /* .basic */ + 0 /* .flags */));
 
     if (STRING_ON_HEAP(flags)) {
         rbperf_read(&char_ptr, 8,
                     (void *)(label + as_offset + 8 /* .long len */));
-        int err = rbperf_read_str(buffer, buffer_len, (void *)(char_ptr));
+        err = rbperf_read_str(buffer, buffer_len, (void *)(char_ptr));
         if (err < 0) {
             LOG("[warn] string @ 0x%llx [heap] failed with err=%d", (void *)(char_ptr), err);
         }
     } else {
-        int err = rbperf_read_str(buffer, buffer_len, (void *)(label + as_offset));
+        err = rbperf_read_str(buffer, buffer_len, (void *)(label + as_offset));
         if (err < 0) {
             LOG("[warn] string @ 0x%llx [stack] failed with err=%d", (void *)(label + as_offset), err);
         }
     }
+
+    if (err < 0) {
+        bump_stat(STAT_READ_STRING_ERRORS);
+    }
+    return err;
+}
+
+// FNV-1a over the string, 8 bytes at a time.
+static inline_method u64 hash_string(RubyString *string) {
+    u64 hash = 0xcbf29ce484222325;
+    u64 word;
+
+#pragma unroll
+    for (int i = 0; i + 8 <= PATH_MAXLEN; i += 8) {
+        __builtin_memcpy(&word, &string->value[i], 8);
+        hash = (hash ^ word) * 0x100000001b3;
+    }
+#pragma unroll
+    for (int i = PATH_MAXLEN / 8 * 8; i < PATH_MAXLEN; i++) {
+        hash = (hash ^ string->value[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// Returns the id of the Ruby string at `label`, which is read every time
+// to tell it apart from an older string at the same address. Strings that
+// can't be read or stored are empty.
+static inline_method u32 find_or_insert_ruby_string(u64 label, RubyString *string) {
+    __builtin_memset(string, 0, sizeof(RubyString));
+    if (read_ruby_string(label, string->value, sizeof(string->value)) < 0) {
+        return EMPTY_STRING_ID;
+    }
+
+    RubyStringKey key = {.address = label, .hash = hash_string(string)};
+    u32 *found_id = bpf_map_lookup_elem(&string_to_id, &key);
+    if (found_id != NULL) {
+        return *found_id;
+    }
+    u32 id = insert_with_new_id(&string_to_id, &id_to_string, STRING_ID_COUNTER, &key, string);
+    return id != 0 ? id : EMPTY_STRING_ID;
+}
+
+static inline_method u32 native_method_name_id(RubyString *string) {
+    // No Ruby string lives at address zero.
+    RubyStringKey key = {};
+    u32 *found_id = bpf_map_lookup_elem(&string_to_id, &key);
+    if (found_id != NULL) {
+        return *found_id;
+    }
+
+    __builtin_memset(string, 0, sizeof(RubyString));
+    bpf_probe_read_kernel_str(string->value, sizeof(NATIVE_METHOD_NAME), NATIVE_METHOD_NAME);
+    return insert_with_new_id(&string_to_id, &id_to_string, STRING_ID_COUNTER, &key, string);
 }
 
 static inline_method int
@@ -151,7 +397,7 @@ read_ruby_lineno(u64 pc, u64 body, RubyVersionOffsets *version_offsets) {
 
 static inline_method void
 read_frame(u64 pc, u64 body, RubyFrame *current_frame,
-           RubyVersionOffsets *version_offsets) {
+           RubyVersionOffsets *version_offsets, RubyString *string) {
     u64 path_addr;
     u64 path;
     u64 label;
@@ -176,6 +422,7 @@ read_frame(u64 pc, u64 body, RubyFrame *current_frame,
 
     } else {
         LOG("[error] read_frame, wrong type");
+        bump_stat(STAT_WRONG_FRAME_TYPE_ERRORS);
         // Skip as we don't have the data types we were looking for
         return;
     }
@@ -183,12 +430,11 @@ read_frame(u64 pc, u64 body, RubyFrame *current_frame,
     rbperf_read(&label, 8,
                 (void *)(body + ruby_location_offset + label_offset));
 
-    read_ruby_string(path, current_frame->path, sizeof(current_frame->path));
+    current_frame->path_id = find_or_insert_ruby_string(path, string);
     current_frame->lineno = read_ruby_lineno(pc, body, version_offsets);
-    read_ruby_string(label, current_frame->method_name,
-                     sizeof(current_frame->method_name));
+    current_frame->method_name_id = find_or_insert_ruby_string(label, string);
 
-    LOG("[debug] method name=%s", current_frame->method_name);
+    LOG("[debug] method name id=%d", current_frame->method_name_id);
 }
 
 SEC("perf_event")
@@ -205,6 +451,7 @@ int walk_ruby_stack(struct bpf_perf_event_data *ctx) {
     }
     RubyVersionOffsets *version_offsets = bpf_map_lookup_elem(&version_specific_offsets, &state->rb_version);
     if (version_offsets == NULL) {
+        bump_stat(STAT_MISSING_VERSION_OFFSETS_ERRORS);
         return 0;  // this should not happen
     }
 
@@ -229,10 +476,12 @@ int walk_ruby_stack(struct bpf_perf_event_data *ctx) {
             // this could be a native frame, it's missing the check though
             // https://github.com/ruby/ruby/blob/4ff3f20/.gdbinit#L1155
             // TODO(javierhonduco): Fetch path for native stacks
-            bpf_probe_read_kernel_str(current_frame.method_name, sizeof(NATIVE_METHOD_NAME), NATIVE_METHOD_NAME);
+            current_frame.method_name_id = native_method_name_id(&state->string);
+            current_frame.path_id = EMPTY_STRING_ID;
+            current_frame.lineno = 0;
         } else {
             rbperf_read(&body, 8, (void *)(iseq_addr + body_offset));
-            read_frame(pc, body, &current_frame, version_offsets);
+            read_frame(pc, body, &current_frame, version_offsets, &state->string);
         }
 
         long long int actual_index = state->stack.size;
@@ -257,122 +506,459 @@ int walk_ruby_stack(struct bpf_perf_event_data *ctx) {
 
     if (state->stack.size != state->stack.expected_size) {
         LOG("[error] stack size %d, expected %d", state->stack.size, state->stack.expected_size);
+        bump_stat(STAT_STACK_SIZE_MISMATCH_ERRORS);
+    }
+
+    if (state->stack.id_generation != current_id_generation()) {
+        // The ids were recycled while walking, the frames may have been
+        // given ids of either generation
+        bump_stat(STAT_ID_RECYCLING_DROPS);
+        return 0;
     }
 
+    long err;
     if (use_ringbuf) {
-        bpf_ringbuf_output(&events, &state->stack, sizeof(RubyStack), 0);
+        void *ringbuf = ringbuf_shard(bpf_get_smp_processor_id() % ringbuf_shards);
+        u64 flags = 0;
+        if (ringbuf_wakeup_threshold > 0) {
+            u64 pending = bpf_ringbuf_query(ringbuf, BPF_RB_AVAIL_DATA) + sizeof(RubyStack);
+            flags = pending >= ringbuf_wakeup_threshold ? BPF_RB_FORCE_WAKEUP : BPF_RB_NO_WAKEUP;
+        }
+        err = bpf_ringbuf_output(ringbuf, &state->stack, sizeof(RubyStack), flags);
+    } else {
+        err = bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &state->stack, sizeof(RubyStack));
+    }
+    if (err == 0) {
+        bump_stat(STAT_SAMPLES_EMITTED);
     } else {
-        bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &state->stack, sizeof(RubyStack));
+        // The buffer was full
+        bump_stat(STAT_OUTPUT_ERRORS);
     }
     return 0;
 }
 
+// PIDs in Linux are reused. To ensure that the process we are
+// profiling is the one we expect, we check the pid + start_time
+// of the process.
+//
+// When we start profiling, the start_time will be zero, so we set
+// it to the actual start time. Otherwise, we check that the start_time
+// of the process matches what we expect. If it's not the case, bail out
+// early, to avoid profiling the wrong process.
+static inline_method bool is_expected_process(ProcessData *process_data) {
+    if (!enable_pid_race_detector) {
+        return true;
+    }
+
+    struct task_struct *task = (void *)bpf_get_current_task();
+    if (task == NULL) {
+        LOG("[error] task_struct was NULL");
+        return false;
+    }
+
+    u64 process_start_time;
+    bpf_core_read(&process_start_time, 8, &task->start_time);
+
+    if (process_data->start_time == 0) {
+        // First time seeing this process
+        process_data->start_time = process_start_time;
+    } else {
+        // Let's check that the start time matches what we saw before
+        if (process_data->start_time != process_start_time) {
+            LOG("[error] the process has probably changed...");
+            bump_stat(STAT_PID_START_TIME_MISMATCH_ERRORS);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the execution context of the VM's main thread.
+static inline_method u64 main_thread_ec(u64 vm_addr, RubyVersionOffsets *version_offsets) {
+    u64 main_thread_addr;
+    u64 ec_addr;
+
+    rbperf_read(&main_thread_addr, 8,
+                (void *)vm_addr + version_offsets->main_thread_offset);
+    rbperf_read(&ec_addr, 8, (void *)main_thread_addr + version_offsets->ec_offset);
+    return ec_addr;
+}
+
+// Whether the VM is in the middle of a garbage collection. The frames on
+// the stack then belong to the code that triggered it, rather than to the
+// code that's running.
+static inline_method bool vm_during_gc(u64 vm_addr, RubyVersionOffsets *version_offsets) {
+    u64 objspace_addr;
+    u32 flags = 0;
+
+    rbperf_read(&objspace_addr, 8, (void *)(vm_addr + version_offsets->objspace_offset));
+    rbperf_read(&flags, 4, (void *)(objspace_addr + objspace_flags_offset));
+    return OBJSPACE_DURING_GC(flags) != 0;
+}
+
+// Sets up the global state to walk the Ruby stack of the execution context
+// at `ec_addr`, and starts walking it in a tail call.
+static inline_method void walk_execution_context(void *ctx, u32 pid, int rb_version,
+                                                 RubyVersionOffsets *version_offsets,
+                                                 u64 ec_addr, u64 weight, bool during_gc) {
+    u64 thread_stack_content;
+    u64 thread_stack_size;
+    u64 cfp;
+    int control_frame_t_sizeof = version_offsets->control_frame_t_sizeof;
+
+    rbperf_read(
+        &thread_stack_content, 8,
+        (void *)(ec_addr + version_offsets->vm_offset));
+    rbperf_read(
+        &thread_stack_size, 8,
+        (void *)(ec_addr + version_offsets->vm_size_offset));
+
+    u64 base_stack = thread_stack_content +
+                     rb_value_sizeof * thread_stack_size -
+                     2 * control_frame_t_sizeof /* skip dummy frames */;
+    rbperf_read(&cfp, 8, (void *)(ec_addr + version_offsets->cfp_offset));
+    int zero = 0;
+    SampleState *state = bpf_map_lookup_elem(&global_state, &zero);
+    if (state == NULL) {
+        return;  // this should never happen
+    }
+
+    u32 generation = current_id_generation();
+    if (generation % 2 != 0) {
+        // Userspace is recycling the ids
+        bump_stat(STAT_ID_RECYCLING_DROPS);
+        return;
+    }
+
+    // Set the global state, shared across bpf tail calls
+    state->stack.timestamp = bpf_ktime_get_ns();
+    state->stack.weight = weight;
+    state->stack.pid = pid;
+    state->stack.cpu = bpf_get_smp_processor_id();
+    state->stack.during_gc = during_gc;
+    state->stack.id_generation = generation;
+    if (event_type == RBPERF_EVENT_SYSCALL) {
+        read_syscall_id(ctx, &state->stack.syscall_id);
+    } else {
+        state->stack.syscall_id = 0;
+    }
+    state->stack.size = 0;
+    state->stack.expected_size = (base_stack - cfp) / control_frame_t_sizeof;
+    bpf_get_current_comm(state->stack.comm, sizeof(state->stack.comm));
+    state->stack.stack_status = STACK_COMPLETE;
+
+    state->base_stack = base_stack;
+    state->cfp = cfp + version_offsets->control_frame_t_sizeof;
+    state->ruby_stack_program_count = 0;
+    state->rb_version = rb_version;
+
+    bpf_tail_call(ctx, &programs, RBPERF_STACK_READING_PROGRAM_IDX);
+}
+
 SEC("perf_event")
 int on_event(struct bpf_perf_event_data *ctx) {
     u64 pid_tgid = bpf_get_current_pid_tgid();
     u32 pid = pid_tgid >> 32;
+    u32 tid = pid_tgid;
     ProcessData *process_data = bpf_map_lookup_elem(&pid_to_rb_thread, &pid);
 
     if (process_data != NULL && process_data->rb_frame_addr != 0) {
+        // Tracepoints, kprobes and software events are hit by whichever
+        // thread runs into them, see `walk_current_thread`
+        u64 *thread_addr = NULL;
+        if (event_type == RBPERF_EVENT_TRACEPOINT || event_type == RBPERF_EVENT_KPROBE ||
+            event_type == RBPERF_EVENT_SOFTWARE) {
+            thread_addr = bpf_map_lookup_elem(&ruby_threads, &tid);
+            if (thread_addr == NULL && tid != pid) {
+                return 0;
+            }
+        }
+
         LOG("[debug] reading Ruby stack");
+        bump_stat(STAT_SAMPLES_SEEN);
 
-        struct task_struct *task = (void *)bpf_get_current_task();
-        if (task == NULL) {
-            LOG("[error] task_struct was NULL");
+        if (!is_expected_process(process_data)) {
             return 0;
         }
 
-        // PIDs in Linux are reused. To ensure that the process we are
-        // profiling is the one we expect, we check the pid + start_time
-        // of the process.
-        //
-        // When we start profiling, the start_time will be zero, so we set
-        // it to the actual start time. Otherwise, we check that the start_time
-        // of the process matches what we expect. If it's not the case, bail out
-        // early, to avoid profiling the wrong process.
-        if (enable_pid_race_detector) {
-            u64 process_start_time;
-            bpf_core_read(&process_start_time, 8, &task->start_time);
-
-            if (process_data->start_time == 0) {
-                // First time seeing this process
-                process_data->start_time = process_start_time;
-            } else {
-                // Let's check that the start time matches what we saw before
-                if (process_data->start_time != process_start_time) {
-                    LOG("[error] the process has probably changed...");
-                    return 0;
-                }
+        u64 weight = 1;
+        if (event_type == RBPERF_EVENT_SYSCALL && syscall_weight_field >= 0) {
+            long value = 0;
+            bpf_probe_read_kernel(&value, 8,
+                                  (void *)ctx + SYSCALL_ARGS_OFFSET + 8 * syscall_weight_field);
+            // Failed calls, and the ones that didn't transfer anything,
+            // weigh nothing.
+            if (value <= 0) {
+                return 0;
             }
+            weight = value;
+        } else if (event_type == RBPERF_EVENT_ON_CPU_SAMPLING || event_type == RBPERF_EVENT_SOFTWARE) {
+            // The sample stands for the cycles or events since the previous
+            // one, the period may have been lengthened by the watchdog.
+            weight = ctx->sample_period;
         }
 
-        u64 ruby_current_thread_addr;
-        u64 main_thread_addr;
-        u64 ec_addr;
-        u64 thread_stack_content;
-        u64 thread_stack_size;
-        u64 cfp;
-        int control_frame_t_sizeof;
+        u64 ruby_current_vm_addr;
         RubyVersionOffsets *version_offsets = bpf_map_lookup_elem(&version_specific_offsets, &process_data->rb_version);
 
         if (version_offsets == NULL) {
             LOG("[error] can't find offsets for version");
+            bump_stat(STAT_MISSING_VERSION_OFFSETS_ERRORS);
             return 0;
         }
 
-        rbperf_read(&ruby_current_thread_addr, 8,
+        rbperf_read(&ruby_current_vm_addr, 8,
                     (void *)process_data->rb_frame_addr);
 
         LOG("process_data->rb_frame_addr 0x%llx", process_data->rb_frame_addr);
-        LOG("ruby_current_thread_addr 0x%llx", ruby_current_thread_addr);
+        LOG("ruby_current_vm_addr 0x%llx", ruby_current_vm_addr);
 
-        // Find the main thread and the ec
-        rbperf_read(&main_thread_addr, 8,
-                    (void *)ruby_current_thread_addr + version_offsets->main_thread_offset);
-        rbperf_read(&ec_addr, 8, (void *)main_thread_addr + version_offsets->ec_offset);
+        u64 ec_addr;
+        if (thread_addr != NULL) {
+            rbperf_read(&ec_addr, 8, (void *)(*thread_addr + version_offsets->thread_ec_offset));
+        } else {
+            ec_addr = main_thread_ec(ruby_current_vm_addr, version_offsets);
+        }
+        bool during_gc = vm_during_gc(ruby_current_vm_addr, version_offsets);
+        walk_execution_context(ctx, pid, process_data->rb_version, version_offsets, ec_addr, weight, during_gc);
+        // This will never be executed
+        return 0;
+    }
+    return 0;
+}
 
-        control_frame_t_sizeof = version_offsets->control_frame_t_sizeof;
+// Attached to the entry of gvl_acquire_common(vm_or_gvl, th), which every
+// thread goes through to take the GVL, waiting there if another thread
+// holds it.
+SEC("uprobe")
+int on_gvl_wait(struct pt_regs *ctx) {
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    u32 tid = pid_tgid;
+    GvlWait wait = {
+        .start_time = bpf_ktime_get_ns(),
+        .thread_addr = PT_REGS_PARM2(ctx),
+    };
+    bpf_map_update_elem(&gvl_waits, &tid, &wait, BPF_ANY);
+    return 0;
+}
 
-        rbperf_read(
-            &thread_stack_content, 8,
-            (void *)(ec_addr + version_offsets->vm_offset));
-        rbperf_read(
-            &thread_stack_size, 8,
-            (void *)(ec_addr + version_offsets->vm_size_offset));
-
-        u64 base_stack = thread_stack_content +
-                         rb_value_sizeof * thread_stack_size -
-                         2 * control_frame_t_sizeof /* skip dummy frames */;
-        rbperf_read(&cfp, 8, (void *)(ec_addr + version_offsets->cfp_offset));
-        int zero = 0;
-        SampleState *state = bpf_map_lookup_elem(&global_state, &zero);
-        if (state == NULL) {
-            return 0;  // this should never happen
-        }
+// Attached to the return of gvl_acquire_common, once the thread holds the
+// GVL. Its Ruby stack didn't change while it waited, so it's walked now,
+// weighted by how long the wait took.
+SEC("uretprobe")
+int on_gvl_acquired(struct pt_regs *ctx) {
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    u32 pid = pid_tgid >> 32;
+    u32 tid = pid_tgid;
 
-        // Set the global state, shared across bpf tail calls
-        state->stack.timestamp = bpf_ktime_get_ns();
-        state->stack.pid = pid;
-        state->stack.cpu = bpf_get_smp_processor_id();
-        if (event_type == RBPERF_EVENT_SYSCALL) {
-            read_syscall_id(ctx, &state->stack.syscall_id);
-        } else {
-            state->stack.syscall_id = 0;
-        }
-        state->stack.size = 0;
-        state->stack.expected_size = (base_stack - cfp) / control_frame_t_sizeof;
-        bpf_get_current_comm(state->stack.comm, sizeof(state->stack.comm));
-        state->stack.stack_status = STACK_COMPLETE;
+    GvlWait *found = bpf_map_lookup_elem(&gvl_waits, &tid);
+    if (found == NULL) {
+        // Started waiting before rbperf was attached
+        return 0;
+    }
+    GvlWait wait = *found;
+    bpf_map_delete_elem(&gvl_waits, &tid);
 
-        state->base_stack = base_stack;
-        state->cfp = cfp + version_offsets->control_frame_t_sizeof;
-        state->ruby_stack_program_count = 0;
-        state->rb_version = process_data->rb_version;
+    u64 waited_ns = bpf_ktime_get_ns() - wait.start_time;
+    if (waited_ns < gvl_min_wait_ns) {
+        return 0;
+    }
 
-        bpf_tail_call(ctx, &programs, RBPERF_STACK_READING_PROGRAM_IDX);
-        // This will never be executed
+    ProcessData *process_data = bpf_map_lookup_elem(&pid_to_rb_thread, &pid);
+    if (process_data == NULL) {
+        return 0;
+    }
+    bump_stat(STAT_SAMPLES_SEEN);
+
+    if (!is_expected_process(process_data)) {
+        return 0;
+    }
+
+    RubyVersionOffsets *version_offsets = bpf_map_lookup_elem(&version_specific_offsets, &process_data->rb_version);
+    if (version_offsets == NULL) {
+        LOG("[error] can't find offsets for version");
+        bump_stat(STAT_MISSING_VERSION_OFFSETS_ERRORS);
         return 0;
     }
+
+    // The waiting thread, which isn't necessarily the main one
+    u64 ec_addr;
+    rbperf_read(&ec_addr, 8, (void *)(wait.thread_addr + version_offsets->thread_ec_offset));
+
+    walk_execution_context(ctx, pid, process_data->rb_version, version_offsets, ec_addr, waited_ns, false);
+    return 0;
+}
+
+// Attached to the entry of gvl_acquire_common(vm_or_gvl, th) for the
+// events that can happen on any thread, to know which Ruby thread runs on
+// each of them.
+SEC("uprobe")
+int on_ruby_thread(struct pt_regs *ctx) {
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    u32 tid = pid_tgid;
+    u64 thread_addr = PT_REGS_PARM2(ctx);
+    bpf_map_update_elem(&ruby_threads, &tid, &thread_addr, BPF_ANY);
+    return 0;
+}
+
+// Walks the stack of the Ruby thread running on the current thread. Until
+// a thread is seen taking the GVL only the main one is known, the events
+// of the others are skipped rather than given the main thread's stack.
+static inline_method void walk_current_thread(void *ctx, u64 weight, bool during_gc) {
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    u32 pid = pid_tgid >> 32;
+    u32 tid = pid_tgid;
+
+    ProcessData *process_data = bpf_map_lookup_elem(&pid_to_rb_thread, &pid);
+    if (process_data == NULL || process_data->rb_frame_addr == 0) {
+        return;
+    }
+    u64 *thread_addr = bpf_map_lookup_elem(&ruby_threads, &tid);
+    if (thread_addr == NULL && tid != pid) {
+        return;
+    }
+    bump_stat(STAT_SAMPLES_SEEN);
+
+    if (!is_expected_process(process_data)) {
+        return;
+    }
+
+    RubyVersionOffsets *version_offsets = bpf_map_lookup_elem(&version_specific_offsets, &process_data->rb_version);
+    if (version_offsets == NULL) {
+        LOG("[error] can't find offsets for version");
+        bump_stat(STAT_MISSING_VERSION_OFFSETS_ERRORS);
+        return;
+    }
+
+    u64 ec_addr;
+    if (thread_addr != NULL) {
+        rbperf_read(&ec_addr, 8, (void *)(*thread_addr + version_offsets->thread_ec_offset));
+    } else {
+        u64 ruby_current_vm_addr;
+        rbperf_read(&ruby_current_vm_addr, 8, (void *)process_data->rb_frame_addr);
+        ec_addr = main_thread_ec(ruby_current_vm_addr, version_offsets);
+    }
+
+    walk_execution_context(ctx, pid, process_data->rb_version, version_offsets, ec_addr, weight, during_gc);
+}
+
+// Attached to the entry of a function whose calls are timed, such as
+// gc_start(objspace, reason), which runs every minor and major GC. With
+// lazy sweeping and incremental marking, some of the GC work is done later
+// in smaller steps, which aren't counted.
+SEC("uprobe")
+int on_call_start(struct pt_regs *ctx) {
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    u32 tid = pid_tgid;
+    u64 start_time = bpf_ktime_get_ns();
+    bpf_map_update_elem(&call_starts, &tid, &start_time, BPF_ANY);
+    return 0;
+}
+
+// Attached to the return of the timed function. The stack that called it
+// is walked now, weighted by how long the call took.
+SEC("uretprobe")
+int on_call_done(struct pt_regs *ctx) {
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    u32 tid = pid_tgid;
+
+    u64 *found = bpf_map_lookup_elem(&call_starts, &tid);
+    if (found == NULL) {
+        // Started before rbperf was attached
+        return 0;
+    }
+    u64 call_ns = bpf_ktime_get_ns() - *found;
+    bpf_map_delete_elem(&call_starts, &tid);
+
+    // The calling thread, such as a web server worker making a query
+    walk_current_thread(ctx, call_ns, event_type == RBPERF_EVENT_GC);
+    return 0;
+}
+
+// Attached to the entry of any function, such as the ones that allocate
+// Ruby objects. Only one in every `uprobe_sample_every` calls is walked,
+// and it stands for all of them in the profile.
+SEC("uprobe")
+int on_uprobe(struct pt_regs *ctx) {
+    u32 zero = 0;
+    u64 *count = bpf_map_lookup_elem(&uprobe_hit_counts, &zero);
+    if (count == NULL) {
+        return 0;  // this should never happen
+    }
+    *count += 1;
+    if (*count < uprobe_sample_every) {
+        return 0;
+    }
+    *count = 0;
+
+    walk_current_thread(ctx, uprobe_sample_every, false);
+    return 0;
+}
+
+// Kernels before 5.14 named `__state` `state`.
+struct task_struct___o {
+    volatile long int state;
+} __attribute__((preserve_access_index));
+
+static inline_method long task_state(struct task_struct *task) {
+    if (bpf_core_field_exists(task->__state)) {
+        return BPF_CORE_READ(task, __state);
+    }
+    struct task_struct___o *old_task = (void *)task;
+    return BPF_CORE_READ(old_task, state);
+}
+
+// Starts timing how long `task` waits in the run queue, if it's a Ruby
+// thread of a profiled process whose stack can be walked, see
+// `walk_current_thread`.
+static inline_method void runqueue_enter(struct task_struct *task) {
+    u32 pid = BPF_CORE_READ(task, tgid);
+    u32 tid = BPF_CORE_READ(task, pid);
+    if (bpf_map_lookup_elem(&pid_to_rb_thread, &pid) == NULL) {
+        return;
+    }
+    if (tid != pid && bpf_map_lookup_elem(&ruby_threads, &tid) == NULL) {
+        return;
+    }
+    u64 start_time = bpf_ktime_get_ns();
+    bpf_map_update_elem(&runqueue_starts, &tid, &start_time, BPF_ANY);
+}
+
+// Attached to try_to_wake_up(p, state, wake_flags) and
+// wake_up_new_task(p), which put threads that were sleeping, or new ones,
+// in the run queue.
+SEC("kprobe")
+int on_task_wakeup(struct pt_regs *ctx) {
+    runqueue_enter((struct task_struct *)PT_REGS_PARM1(ctx));
+    return 0;
+}
+
+// Attached to finish_task_switch(prev), which runs in the thread switched
+// in, right before it starts running. Threads that were preempted go back
+// to the run queue, and the one switched in leaves it. Its stack didn't
+// change while it waited, so it's walked now, weighted by the delay.
+SEC("kprobe")
+int on_task_switch_in(struct pt_regs *ctx) {
+    struct task_struct *prev = (struct task_struct *)PT_REGS_PARM1(ctx);
+    if (task_state(prev) == TASK_RUNNING) {
+        runqueue_enter(prev);
+    }
+
+    u64 pid_tgid = bpf_get_current_pid_tgid();
+    u32 tid = pid_tgid;
+
+    u64 *found = bpf_map_lookup_elem(&runqueue_starts, &tid);
+    if (found == NULL) {
+        return 0;
+    }
+    u64 delay_ns = bpf_ktime_get_ns() - *found;
+    bpf_map_delete_elem(&runqueue_starts, &tid);
+    if (delay_ns < runqueue_min_delay_ns) {
+        return 0;
+    }
+
+    // The thread switched in, which isn't necessarily the main one
+    walk_current_thread(ctx, delay_ns, false);
     return 0;
 }
 
@@ -6,13 +6,24 @@
 #include "basic_types.h"
 
 #define COMM_MAXLEN 25
-#define METHOD_MAXLEN 50
 #define PATH_MAXLEN 150
 
 #define MAX_STACKS_PER_PROGRAM 30
 #define BPF_PROGRAMS_COUNT 5
 #define MAX_STACK (MAX_STACKS_PER_PROGRAM * BPF_PROGRAMS_COUNT)
 #define RBPERF_STACK_READING_PROGRAM_IDX 0
+// The ring buffer can be sharded by CPU to avoid contention on its lock,
+// `events` is the first shard.
+#define MAX_RINGBUF_SHARDS 8
+
+// Frame and string ids are allocated from per-CPU counters, with the CPU
+// number in the high bits, so they never collide across CPUs and are never
+// zero. Counters don't wrap around, as userspace keeps every id it copied.
+#define ID_CPU_SHIFT 20
+#define ID_COUNTER_MASK ((1 << ID_CPU_SHIFT) - 1)
+// Never allocated, stands for the empty string: the path of native frames
+// and the strings that couldn't be read or stored.
+#define EMPTY_STRING_ID 0
 
 #define rbperf_read bpf_probe_read_user
 #define rbperf_read_str bpf_probe_read_user_str
@@ -35,6 +46,14 @@
 
 #define as_offset 0x10
 
+// The GC flags in rb_objspace_t, from gc.c. They are at the same place in
+// all the supported versions.
+#define objspace_flags_offset 0x10  // offsetof(rb_objspace_t, flags)
+#define OBJSPACE_DURING_GC(flags) ((flags) & (1 << 5))
+
+// The state of a runnable task, from include/linux/sched.h.
+#define TASK_RUNNING 0
+
 #define STRING_ON_HEAP(flags) flags &(1 << 13)
 #define inline_method inline __attribute__((__always_inline__))
 
@@ -51,6 +70,9 @@
 // - [1] /sys/kernel/debug/tracing/events/syscalls/*/format
 #define SYSCALL_NR_OFFSET 8
 #define SYSCALL_NR_SIZE 4
+// The 8 byte arguments in sys_enter tracepoints, or the return value in
+// sys_exit ones, follow the syscall number.
+#define SYSCALL_ARGS_OFFSET 16
 
 static char NATIVE_METHOD_NAME[] = "<native code>";
 
@@ -59,23 +81,76 @@ enum ruby_stack_status {
     STACK_INCOMPLETE = 1,
 };
 
+enum id_counter_kind {
+    FRAME_ID_COUNTER = 0,
+    STRING_ID_COUNTER = 1,
+    ID_COUNTER_KINDS = 2,
+};
+
+// Counters kept in BPF and read by userspace into `Stats`.
+enum rbperf_stat {
+    STAT_SAMPLES_SEEN = 0,
+    STAT_SAMPLES_EMITTED = 1,
+    STAT_READ_STRING_ERRORS = 2,
+    STAT_WRONG_FRAME_TYPE_ERRORS = 3,
+    STAT_STACK_SIZE_MISMATCH_ERRORS = 4,
+    STAT_MISSING_VERSION_OFFSETS_ERRORS = 5,
+    STAT_PID_START_TIME_MISMATCH_ERRORS = 6,
+    STAT_ID_INSERT_ERRORS = 7,
+    STAT_OUTPUT_ERRORS = 8,
+    STAT_IDS_EXHAUSTED_ERRORS = 9,
+    STAT_ID_RECYCLING_DROPS = 10,
+    STAT_COUNT = 11,
+};
+
 enum rbperf_event_type {
     RBPERF_EVENT_SYSCALL_UNKNOWN = 0,
     RBPERF_EVENT_ON_CPU_SAMPLING = 1,
     RBPERF_EVENT_SYSCALL = 2,
+    RBPERF_EVENT_GVL = 3,
+    RBPERF_EVENT_GC = 4,
+    RBPERF_EVENT_ALLOCATION = 5,
+    RBPERF_EVENT_UPROBE = 6,
+    RBPERF_EVENT_LATENCY = 7,
+    RBPERF_EVENT_TRACEPOINT = 8,
+    RBPERF_EVENT_KPROBE = 9,
+    RBPERF_EVENT_SOFTWARE = 10,
+    RBPERF_EVENT_RUNQUEUE = 11,
 };
 
+typedef struct {
+    char value[PATH_MAXLEN];
+} RubyString;
+
+// Strings are interned by the address of the Ruby string they were read
+// from and a hash of their contents, as the address can be reused by
+// another string once the GC frees or compacts it.
+typedef struct {
+    u64 address;
+    u64 hash;
+} RubyStringKey;
+
+// Method names and paths are ids into the id_to_string map.
 typedef struct {
     u32 lineno;
-    char method_name[METHOD_MAXLEN];
-    char path[PATH_MAXLEN];
+    u32 method_name_id;
+    u32 path_id;
 } RubyFrame;
 
 typedef struct {
     u64 timestamp;
+    // What the sample counts for in the profile: the time spent waiting in
+    // nanoseconds for GVL waits and in the run queue, the call duration
+    // for GCs and timed calls, the calls each sample stands for when sampling uprobes, the
+    // chosen argument or return value for weighted syscalls, otherwise 1.
+    u64 weight;
     u32 frames[MAX_STACK];
     u32 pid;
     u32 cpu;
+    // Whether the sample was taken while the VM was garbage collecting.
+    u32 during_gc;
+    // The generation of the ids in `frames`, see `id_generation`.
+    u32 id_generation;
     // Only set when tracing syscalls.
     int syscall_id;
     long long int size;
@@ -86,6 +161,8 @@ typedef struct {
 
 typedef struct {
     RubyStack stack;
+    // Scratch space to read strings into, as they don't fit in the BPF stack.
+    RubyString string;
     u64 base_stack;
     u64 cfp;
     int ruby_stack_program_count;
@@ -98,6 +175,13 @@ typedef struct {
     u64 start_time;
 } ProcessData;
 
+// A thread waiting for the GVL.
+typedef struct {
+    u64 start_time;
+    // The thread's rb_thread_t.
+    u64 thread_addr;
+} GvlWait;
+
 typedef struct {
     int major_version;
     int minor_version;
@@ -113,4 +197,6 @@ typedef struct {
     int lineno_offset;
     int main_thread_offset;
     int ec_offset;
+    int thread_ec_offset;
+    int objspace_offset;
 } RubyVersionOffsets;
\ No newline at end of file
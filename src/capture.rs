@@ -0,0 +1,211 @@
+use std::io::{Read, Write};
+use std::mem::size_of;
+
+use anyhow::{anyhow, Result};
+
+use crate::id_cache::IdCache;
+use crate::profile::WeightUnit;
+use crate::ruby_readers::{any_as_u8_slice, parse_frame, parse_stack};
+use crate::{RubyFrame, RubyStack};
+
+// Raw captures are only meant to be replayed by the same build of rbperf,
+// the frames and stacks are written with their in-memory layout.
+const MAGIC: &[u8; 8] = b"RBPFRAW\0";
+const VERSION: u32 = 1;
+
+/// The stacks sent by BPF along with the frames and strings they refer
+/// to, enough to process them again without BPF.
+pub struct Capture {
+    // Add the syscall as the leaf frame.
+    pub syscall_frames: bool,
+    // What the stack weights are, which also names them in the outputs.
+    pub unit: WeightUnit,
+    pub frames: IdCache<RubyFrame>,
+    pub strings: IdCache<String>,
+    pub stacks: Vec<RubyStack>,
+}
+
+fn write_u32(writer: &mut impl Write, value: u32) -> Result<()> {
+    writer.write_all(&value.to_le_bytes())?;
+    Ok(())
+}
+
+fn read_u32(reader: &mut impl Read) -> Result<u32> {
+    let mut bytes = [0; 4];
+    reader.read_exact(&mut bytes)?;
+    Ok(u32::from_le_bytes(bytes))
+}
+
+fn unit_code(unit: WeightUnit) -> u32 {
+    match unit {
+        WeightUnit::Count => 0,
+        WeightUnit::Nanoseconds => 1,
+        WeightUnit::Bytes => 2,
+        WeightUnit::Pages => 3,
+        WeightUnit::Cycles => 4,
+    }
+}
+
+fn unit_from_code(code: u32) -> Result<WeightUnit> {
+    match code {
+        0 => Ok(WeightUnit::Count),
+        1 => Ok(WeightUnit::Nanoseconds),
+        2 => Ok(WeightUnit::Bytes),
+        3 => Ok(WeightUnit::Pages),
+        4 => Ok(WeightUnit::Cycles),
+        _ => Err(anyhow!("unknown weight unit {} in the raw capture", code)),
+    }
+}
+
+fn read_bytes(reader: &mut impl Read, len: usize) -> Result<Vec<u8>> {
+    let mut bytes = vec![0; len];
+    reader.read_exact(&mut bytes)?;
+    Ok(bytes)
+}
+
+pub fn write_capture(
+    writer: &mut impl Write,
+    syscall_frames: bool,
+    unit: WeightUnit,
+    frames: &IdCache<RubyFrame>,
+    strings: &IdCache<String>,
+    stacks: &[RubyStack],
+) -> Result<()> {
+    writer.write_all(MAGIC)?;
+    write_u32(writer, VERSION)?;
+    write_u32(writer, size_of::<RubyFrame>() as u32)?;
+    write_u32(writer, size_of::<RubyStack>() as u32)?;
+    write_u32(writer, syscall_frames as u32)?;
+    write_u32(writer, unit_code(unit))?;
+
+    write_u32(writer, strings.len() as u32)?;
+    for (id, string) in strings.iter() {
+        write_u32(writer, id)?;
+        write_u32(writer, string.len() as u32)?;
+        writer.write_all(string.as_bytes())?;
+    }
+
+    write_u32(writer, frames.len() as u32)?;
+    for (id, frame) in frames.iter() {
+        write_u32(writer, id)?;
+        writer.write_all(unsafe { any_as_u8_slice(frame) })?;
+    }
+
+    write_u32(writer, stacks.len() as u32)?;
+    for stack in stacks {
+        writer.write_all(unsafe { any_as_u8_slice(stack) })?;
+    }
+    Ok(())
+}
+
+pub fn read_capture(reader: &mut impl Read) -> Result<Capture> {
+    let magic = read_bytes(reader, MAGIC.len())?;
+    if magic != MAGIC {
+        return Err(anyhow!("not an rbperf raw capture"));
+    }
+    let version = read_u32(reader)?;
+    let frame_size = read_u32(reader)? as usize;
+    let stack_size = read_u32(reader)? as usize;
+    if version != VERSION
+        || frame_size != size_of::<RubyFrame>()
+        || stack_size != size_of::<RubyStack>()
+    {
+        return Err(anyhow!(
+            "the raw capture was written by an incompatible version of rbperf"
+        ));
+    }
+    let syscall_frames = read_u32(reader)? != 0;
+    let unit = unit_from_code(read_u32(reader)?)?;
+
+    let mut strings = IdCache::new();
+    for _ in 0..read_u32(reader)? {
+        let id = read_u32(reader)?;
+        let len = read_u32(reader)? as usize;
+        strings.insert(id, String::from_utf8(read_bytes(reader, len)?)?);
+    }
+
+    let mut frames = IdCache::new();
+    for _ in 0..read_u32(reader)? {
+        let id = read_u32(reader)?;
+        let bytes = read_bytes(reader, frame_size)?;
+        frames.insert(id, unsafe { parse_frame(&bytes) });
+    }
+
+    let stack_count = read_u32(reader)?;
+    let mut stacks = Vec::with_capacity(stack_count as usize);
+    let mut bytes = vec![0; stack_size];
+    for _ in 0..stack_count {
+        reader.read_exact(&mut bytes)?;
+        stacks.push(unsafe { parse_stack(&bytes) });
+    }
+
+    Ok(Capture {
+        syscall_frames,
+        unit,
+        frames,
+        strings,
+        stacks,
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::id_cache::make_id;
+    use crate::{ruby_stack_status_STACK_COMPLETE, COMM_MAXLEN, MAX_STACK};
+
+    #[test]
+    fn test_roundtrip() {
+        let mut strings = IdCache::new();
+        strings.insert(make_id(0, 1), "a_method".to_string());
+        strings.insert(make_id(1, 1), "a_file.rb".to_string());
+        let frame = RubyFrame {
+            lineno: 10,
+            method_name_id: make_id(0, 1),
+            path_id: make_id(1, 1),
+        };
+        let mut frames = IdCache::new();
+        frames.insert(make_id(2, 5), frame);
+
+        let mut stack_frames = [0; MAX_STACK as usize];
+        stack_frames[0] = make_id(2, 5);
+        let stack = RubyStack {
+            timestamp: 1,
+            weight: 1,
+            frames: stack_frames,
+            pid: 42,
+            cpu: 2,
+            during_gc: 0,
+            id_generation: 0,
+            syscall_id: 0,
+            size: 1,
+            expected_size: 1,
+            comm: [0; COMM_MAXLEN as usize],
+            stack_status: ruby_stack_status_STACK_COMPLETE,
+        };
+
+        let mut buffer = Vec::new();
+        write_capture(
+            &mut buffer,
+            true,
+            WeightUnit::Bytes,
+            &frames,
+            &strings,
+            &[stack],
+        )
+        .unwrap();
+        let capture = read_capture(&mut buffer.as_slice()).unwrap();
+
+        assert!(capture.syscall_frames);
+        assert_eq!(capture.unit, WeightUnit::Bytes);
+        assert_eq!(capture.stacks, vec![stack]);
+        assert_eq!(capture.strings.get(make_id(0, 1)).unwrap(), "a_method");
+        assert_eq!(capture.strings.get(make_id(1, 1)).unwrap(), "a_file.rb");
+        assert_eq!(capture.frames.get(make_id(2, 5)).unwrap().lineno, 10);
+    }
+
+    #[test]
+    fn test_rejects_other_files() {
+        assert!(read_capture(&mut &b"not a capture at all"[..]).is_err());
+    }
+}
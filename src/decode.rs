@@ -0,0 +1,381 @@
+use std::thread;
+
+use log::debug;
+use proc_maps::Pid;
+
+use crate::id_cache::IdCache;
+use crate::profile::Profile;
+use crate::ruby_readers::str_from_u8_nul;
+use crate::{ruby_stack_status_STACK_INCOMPLETE, RubyFrame, RubyStack, EMPTY_STRING_ID};
+
+// Below this many stacks per worker, spawning threads costs more than it
+// saves.
+const MIN_STACKS_PER_WORKER: usize = 1024;
+
+// Stands in for a method or path whose string could not be read.
+const UNKNOWN_STRING: &str = "<unknown>";
+
+/// Errors found while turning stacks into samples, see `Stats`.
+#[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
+pub struct DecodeStats {
+    pub total_events: u32,
+    pub map_reading_errors: u32,
+    pub incomplete_stack_errors: u32,
+    // Samples kept with a method name or path that couldn't be resolved.
+    pub unresolved_string_errors: u32,
+    // Samples dropped as fewer frames than their size could be resolved.
+    pub frame_count_mismatch_errors: u32,
+    pub garbled_data_errors: u32,
+    // Samples taken during a garbage collection.
+    pub gc_events: u32,
+}
+
+impl DecodeStats {
+    pub fn merge(&mut self, other: &DecodeStats) {
+        self.total_events += other.total_events;
+        self.map_reading_errors += other.map_reading_errors;
+        self.incomplete_stack_errors += other.incomplete_stack_errors;
+        self.unresolved_string_errors += other.unresolved_string_errors;
+        self.frame_count_mismatch_errors += other.frame_count_mismatch_errors;
+        self.garbled_data_errors += other.garbled_data_errors;
+        self.gc_events += other.gc_events;
+    }
+
+    // The frame count mismatches aren't counted, the frame that couldn't
+    // be resolved already is.
+    pub fn total_errors(&self) -> u32 {
+        self.map_reading_errors
+            + self.incomplete_stack_errors
+            + self.unresolved_string_errors
+            + self.garbled_data_errors
+    }
+}
+
+/// Resolves the frame and string ids in the stacks sent by BPF and adds
+/// them to a profile.
+pub struct Decoder<'a> {
+    frames: &'a IdCache<RubyFrame>,
+    strings: &'a IdCache<String>,
+    // Add the syscall as the leaf frame.
+    syscall_frames: bool,
+}
+
+impl<'a> Decoder<'a> {
+    pub fn new(
+        frames: &'a IdCache<RubyFrame>,
+        strings: &'a IdCache<String>,
+        syscall_frames: bool,
+    ) -> Self {
+        Decoder {
+            frames,
+            strings,
+            syscall_frames,
+        }
+    }
+
+    // The empty string has a reserved id, see `EMPTY_STRING_ID`.
+    fn string(&self, id: u32) -> Option<&str> {
+        if id == EMPTY_STRING_ID {
+            return Some("");
+        }
+        self.strings.get(id).map(|string| string.as_str())
+    }
+
+    pub fn decode(&self, data: &RubyStack, profile: &mut Profile, stats: &mut DecodeStats) {
+        let mut read_frame_count = 0;
+        stats.total_events += 1;
+
+        if data.stack_status == ruby_stack_status_STACK_INCOMPLETE {
+            // TODO: allow users to decide wether to discard incomplete stacks
+            debug!("incomplete stack");
+            stats.incomplete_stack_errors += 1;
+            return;
+        }
+
+        if data.pid == 0 {
+            panic!("pid is zero, this should never happen");
+        }
+
+        let comm_bytes: Vec<u8> = data.comm.iter().map(|&c| c as u8).collect();
+        let comm = unsafe { str_from_u8_nul(&comm_bytes) };
+        if comm.is_err() {
+            stats.garbled_data_errors += 1;
+            return;
+        }
+        let comm = comm.expect("comm should be valid unicode").to_string();
+        let mut frames: Vec<(String, String)> = Vec::new();
+        let mut unresolved_strings = false;
+
+        for frame_idx in &data.frames {
+            // Don't read past the last frame
+            if read_frame_count >= data.size {
+                continue;
+            }
+
+            // Frame id zero means that the frame could not be
+            // stored in BPF. The sample is discarded on the first frame
+            // that can't be resolved.
+            let frame = match self.frames.get(*frame_idx) {
+                Some(frame) => frame,
+                None => {
+                    debug!("Frame id {} could not be resolved", frame_idx);
+                    stats.map_reading_errors += 1;
+                    break;
+                }
+            };
+            // A string that can't be resolved only loses that name, the
+            // rest of the stack is still good.
+            let mut resolve = |id: u32| match self.string(id) {
+                Some(string) => string.to_string(),
+                None => {
+                    debug!("String id {} could not be resolved", id);
+                    unresolved_strings = true;
+                    UNKNOWN_STRING.to_string()
+                }
+            };
+            let method_name = resolve(frame.method_name_id);
+            let path_name = resolve(frame.path_id);
+
+            frames.push((method_name, path_name));
+            read_frame_count += 1;
+        }
+
+        // Add generated frames
+        if data.during_gc != 0 {
+            // As the leaf, on top of the code that triggered the GC
+            frames.insert(0, ("<garbage collection>".to_string(), "<gc>".to_string()));
+        }
+        if self.syscall_frames {
+            let syscall_number = syscalls::Sysno::from(data.syscall_id);
+            frames.push((
+                format!("{}", syscall_number).to_string(),
+                "<syscall>".to_string(),
+            ));
+        }
+
+        if unresolved_strings {
+            stats.unresolved_string_errors += 1;
+        }
+
+        if data.size == read_frame_count {
+            if data.during_gc != 0 {
+                stats.gc_events += 1;
+            }
+            profile.add_weighted_sample(data.pid as Pid, comm, frames, data.weight);
+        } else {
+            debug!(
+                "mismatched expected={} and received={} frame count",
+                data.size, read_frame_count
+            );
+            stats.frame_count_mismatch_errors += 1;
+        }
+    }
+
+    /// Decodes `stacks` on up to `workers` threads, each one into its own
+    /// profile, which are then merged in order.
+    pub fn decode_all(&self, stacks: &[RubyStack], workers: usize) -> (Profile, DecodeStats) {
+        let workers = workers.min(stacks.len() / MIN_STACKS_PER_WORKER).max(1);
+        let decode_chunk = |chunk: &[RubyStack]| {
+            let mut profile = Profile::new();
+            let mut stats = DecodeStats::default();
+            for stack in chunk {
+                self.decode(stack, &mut profile, &mut stats);
+            }
+            (profile, stats)
+        };
+
+        if workers == 1 {
+            return decode_chunk(stacks);
+        }
+
+        let chunk_size = (stacks.len() + workers - 1) / workers;
+        let partials: Vec<(Profile, DecodeStats)> = thread::scope(|scope| {
+            let handles: Vec<_> = stacks
+                .chunks(chunk_size)
+                .map(|chunk| scope.spawn(move || decode_chunk(chunk)))
+                .collect();
+            handles
+                .into_iter()
+                .map(|handle| handle.join().expect("decoding thread panicked"))
+                .collect()
+        });
+
+        let mut profile = Profile::new();
+        let mut stats = DecodeStats::default();
+        for (partial_profile, partial_stats) in partials {
+            profile.merge(partial_profile);
+            stats.merge(&partial_stats);
+        }
+        (profile, stats)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::id_cache::make_id;
+    use crate::{ruby_stack_status_STACK_COMPLETE, COMM_MAXLEN, MAX_STACK};
+
+    fn caches() -> (IdCache<RubyFrame>, IdCache<String>) {
+        let mut frames = IdCache::new();
+        let mut strings = IdCache::new();
+        for i in 1..=3 {
+            strings.insert(make_id(0, i), format!("method_{}", i));
+        }
+        strings.insert(make_id(0, 4), "file.rb".to_string());
+        for i in 1..=3 {
+            frames.insert(
+                make_id(1, i),
+                RubyFrame {
+                    lineno: i,
+                    method_name_id: make_id(0, i),
+                    path_id: make_id(0, 4),
+                },
+            );
+        }
+        (frames, strings)
+    }
+
+    fn stack(pid: u32, frame_ids: &[u32]) -> RubyStack {
+        let mut frames = [0; MAX_STACK as usize];
+        frames[..frame_ids.len()].copy_from_slice(frame_ids);
+        let mut comm = [0; COMM_MAXLEN as usize];
+        comm[0] = b'r' as _;
+        comm[1] = b'b' as _;
+        RubyStack {
+            timestamp: 0,
+            weight: 1,
+            frames,
+            pid,
+            cpu: 0,
+            during_gc: 0,
+            id_generation: 0,
+            syscall_id: 0,
+            size: frame_ids.len() as i64,
+            expected_size: frame_ids.len() as i64,
+            comm,
+            stack_status: ruby_stack_status_STACK_COMPLETE,
+        }
+    }
+
+    #[test]
+    fn test_decode_counts_unresolved_frames() {
+        let (frames, strings) = caches();
+        let decoder = Decoder::new(&frames, &strings, false);
+        let mut profile = Profile::new();
+        let mut stats = DecodeStats::default();
+
+        decoder.decode(
+            &stack(1, &[make_id(1, 1), make_id(1, 2)]),
+            &mut profile,
+            &mut stats,
+        );
+        decoder.decode(&stack(1, &[make_id(1, 9)]), &mut profile, &mut stats);
+
+        assert_eq!(stats.total_events, 2);
+        assert_eq!(stats.map_reading_errors, 1);
+        assert_eq!(stats.frame_count_mismatch_errors, 1);
+        assert_eq!(stats.total_errors(), 1);
+        assert_eq!(
+            profile.folded(),
+            "method_2 - file.rb;method_1 - file.rb 1\n"
+        );
+    }
+
+    #[test]
+    fn test_decode_native_frames_have_an_empty_path() {
+        let (mut frames, strings) = caches();
+        frames.insert(
+            make_id(1, 4),
+            RubyFrame {
+                lineno: 0,
+                method_name_id: make_id(0, 1),
+                path_id: EMPTY_STRING_ID,
+            },
+        );
+        let decoder = Decoder::new(&frames, &strings, false);
+        let mut profile = Profile::new();
+        let mut stats = DecodeStats::default();
+
+        decoder.decode(
+            &stack(1, &[make_id(1, 4), make_id(1, 2)]),
+            &mut profile,
+            &mut stats,
+        );
+
+        assert_eq!(stats.unresolved_string_errors, 0);
+        assert_eq!(profile.folded(), "method_2 - file.rb;method_1 -  1\n");
+    }
+
+    #[test]
+    fn test_decode_keeps_samples_with_unresolved_strings() {
+        let (mut frames, strings) = caches();
+        frames.insert(
+            make_id(1, 4),
+            RubyFrame {
+                lineno: 4,
+                method_name_id: make_id(0, 9),
+                path_id: make_id(0, 8),
+            },
+        );
+        let decoder = Decoder::new(&frames, &strings, false);
+        let mut profile = Profile::new();
+        let mut stats = DecodeStats::default();
+
+        decoder.decode(
+            &stack(1, &[make_id(1, 4), make_id(1, 2)]),
+            &mut profile,
+            &mut stats,
+        );
+
+        assert_eq!(stats.unresolved_string_errors, 1);
+        assert_eq!(stats.incomplete_stack_errors, 0);
+        assert_eq!(stats.frame_count_mismatch_errors, 0);
+        assert_eq!(
+            profile.folded(),
+            "method_2 - file.rb;<unknown> - <unknown> 1\n"
+        );
+    }
+
+    #[test]
+    fn test_decode_adds_gc_leaf_frame() {
+        let (frames, strings) = caches();
+        let decoder = Decoder::new(&frames, &strings, false);
+        let mut profile = Profile::new();
+        let mut stats = DecodeStats::default();
+
+        let mut gc_stack = stack(1, &[make_id(1, 1), make_id(1, 2)]);
+        gc_stack.during_gc = 1;
+        decoder.decode(&gc_stack, &mut profile, &mut stats);
+
+        assert_eq!(stats.gc_events, 1);
+        assert_eq!(
+            profile.folded(),
+            "method_2 - file.rb;method_1 - file.rb;<garbage collection> - <gc> 1\n"
+        );
+    }
+
+    #[test]
+    fn test_decode_all_matches_single_threaded() {
+        let (frames, strings) = caches();
+        let decoder = Decoder::new(&frames, &strings, false);
+        let stacks: Vec<RubyStack> = (0..10_000)
+            .map(|i| {
+                let ids: Vec<u32> = (1..=(i % 3 + 1)).map(|f| make_id(1, f)).collect();
+                stack(1 + i % 5, &ids)
+            })
+            .collect();
+
+        let (single, single_stats) = decoder.decode_all(&stacks, 1);
+        let (multi, multi_stats) = decoder.decode_all(&stacks, 4);
+
+        assert_eq!(single_stats, multi_stats);
+        assert_eq!(multi_stats.total_events, 10_000);
+        let sorted = |folded: String| {
+            let mut lines: Vec<String> = folded.lines().map(|l| l.to_string()).collect();
+            lines.sort();
+            lines
+        };
+        assert_eq!(sorted(single.folded()), sorted(multi.folded()));
+    }
+}
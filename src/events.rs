@@ -1,5 +1,7 @@
+use std::fmt;
 use std::fs;
 use std::os::raw::{c_int, c_ulong};
+use std::str::FromStr;
 
 use anyhow::{anyhow, Result};
 use errno::errno;
@@ -12,7 +14,7 @@ use thiserror::Error;
 
 #[derive(Error, Debug)]
 pub enum EventError {
-    #[error("syscall {name:?} doesn't exist")]
+    #[error("event {name:?} doesn't exist")]
     EventNameDoesNotExist { name: String },
 }
 
@@ -42,14 +44,134 @@ unsafe fn perf_event_open(
     sys::perf_event_open(attrs, pid, cpu, group_fd, flags) as c_int
 }
 
+/// # Safety
+pub unsafe fn set_sample_period(fd: c_int, sample_period: u64) -> Result<()> {
+    let mut period = sample_period;
+    if sys::ioctls::PERIOD(fd, &mut period) < 0 {
+        return Err(anyhow!(
+            "setting sample period failed with errno {}",
+            errno()
+        ));
+    }
+    Ok(())
+}
+
+/// # Safety
+pub unsafe fn enable_event(fd: c_int, enable: bool) -> Result<()> {
+    let ret = if enable {
+        sys::ioctls::ENABLE(fd, 0)
+    } else {
+        sys::ioctls::DISABLE(fd, 0)
+    };
+    if ret < 0 {
+        return Err(anyhow!("toggling perf event failed with errno {}", errno()));
+    }
+    Ok(())
+}
+
+/// Events counted by the kernel, which don't need hardware performance
+/// counters. Named as in perf(1).
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum SoftwareEvent {
+    CpuClock,
+    PageFaults,
+    MinorFaults,
+    MajorFaults,
+    ContextSwitches,
+    CpuMigrations,
+}
+
+impl SoftwareEvent {
+    const ALL: [SoftwareEvent; 6] = [
+        SoftwareEvent::CpuClock,
+        SoftwareEvent::PageFaults,
+        SoftwareEvent::MinorFaults,
+        SoftwareEvent::MajorFaults,
+        SoftwareEvent::ContextSwitches,
+        SoftwareEvent::CpuMigrations,
+    ];
+
+    fn name(&self) -> &'static str {
+        match self {
+            SoftwareEvent::CpuClock => "cpu-clock",
+            SoftwareEvent::PageFaults => "page-faults",
+            SoftwareEvent::MinorFaults => "minor-faults",
+            SoftwareEvent::MajorFaults => "major-faults",
+            SoftwareEvent::ContextSwitches => "context-switches",
+            SoftwareEvent::CpuMigrations => "cpu-migrations",
+        }
+    }
+
+    fn config(&self) -> u32 {
+        match self {
+            SoftwareEvent::CpuClock => sys::bindings::PERF_COUNT_SW_CPU_CLOCK,
+            SoftwareEvent::PageFaults => sys::bindings::PERF_COUNT_SW_PAGE_FAULTS,
+            SoftwareEvent::MinorFaults => sys::bindings::PERF_COUNT_SW_PAGE_FAULTS_MIN,
+            SoftwareEvent::MajorFaults => sys::bindings::PERF_COUNT_SW_PAGE_FAULTS_MAJ,
+            SoftwareEvent::ContextSwitches => sys::bindings::PERF_COUNT_SW_CONTEXT_SWITCHES,
+            SoftwareEvent::CpuMigrations => sys::bindings::PERF_COUNT_SW_CPU_MIGRATIONS,
+        }
+    }
+}
+
+impl fmt::Display for SoftwareEvent {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "{}", self.name())
+    }
+}
+
+impl FromStr for SoftwareEvent {
+    type Err = String;
+
+    fn from_str(name: &str) -> Result<Self, Self::Err> {
+        SoftwareEvent::ALL
+            .into_iter()
+            .find(|event| event.name() == name)
+            .ok_or_else(|| {
+                let names: Vec<&str> = SoftwareEvent::ALL.iter().map(|e| e.name()).collect();
+                format!(
+                    "unknown software event {:?}, expected one of {}",
+                    name,
+                    names.join(", ")
+                )
+            })
+    }
+}
+
 /// # Safety
 pub unsafe fn setup_perf_event(cpu: i32, sample_period: u64) -> Result<c_int> {
-    let mut attrs = perf_event_open_sys::bindings::perf_event_attr {
+    let attrs = perf_event_open_sys::bindings::perf_event_attr {
         size: std::mem::size_of::<sys::bindings::perf_event_attr>() as u32,
         type_: sys::bindings::PERF_TYPE_HARDWARE,
         config: sys::bindings::PERF_COUNT_SW_CPU_CLOCK as u64,
         ..Default::default()
     };
+    open_sampling_event(attrs, cpu, sample_period)
+}
+
+/// Samples the software `event` on `cpu` once every `sample_period`
+/// occurrences.
+///
+/// # Safety
+pub unsafe fn setup_software_event(
+    cpu: i32,
+    event: SoftwareEvent,
+    sample_period: u64,
+) -> Result<c_int> {
+    let attrs = perf_event_open_sys::bindings::perf_event_attr {
+        size: std::mem::size_of::<sys::bindings::perf_event_attr>() as u32,
+        type_: sys::bindings::PERF_TYPE_SOFTWARE,
+        config: event.config() as u64,
+        ..Default::default()
+    };
+    open_sampling_event(attrs, cpu, sample_period)
+}
+
+unsafe fn open_sampling_event(
+    mut attrs: perf_event_attr,
+    cpu: i32,
+    sample_period: u64,
+) -> Result<c_int> {
     attrs.__bindgen_anon_1.sample_period = sample_period;
     attrs.set_disabled(1);
 
@@ -70,22 +192,27 @@ pub unsafe fn setup_perf_event(cpu: i32, sample_period: u64) -> Result<c_int> {
 
 /// # Safety
 pub unsafe fn setup_syscall_event(syscall: &str) -> Result<c_int> {
+    setup_tracepoint_event("syscalls", &format!("sys_{}", syscall))
+}
+
+/// Opens the tracepoint `category:name`, such as `sched:sched_process_fork`.
+/// The BPF program attached to it runs on every CPU.
+///
+/// # Safety
+pub unsafe fn setup_tracepoint_event(category: &str, name: &str) -> Result<c_int> {
     let mut attrs = perf_event_open_sys::bindings::perf_event_attr {
         size: std::mem::size_of::<sys::bindings::perf_event_attr>() as u32,
         type_: sys::bindings::PERF_TYPE_TRACEPOINT,
         ..Default::default()
     };
 
-    let path = format!(
-        "/sys/kernel/debug/tracing/events/syscalls/sys_{}/id",
-        syscall
-    );
+    let path = format!("/sys/kernel/debug/tracing/events/{}/{}/id", category, name);
     let mut id = fs::read_to_string(&path).map_err(|_| EventError::EventNameDoesNotExist {
-        name: syscall.to_string(),
+        name: format!("{}:{}", category, name),
     })?;
 
     id.pop(); // Remove newline
-    debug!("syscall with id {} found in {}", id, &path);
+    debug!("tracepoint with id {} found in {}", id, &path);
 
     attrs.config = id.parse::<u64>()?;
     // attrs.__bindgen_anon_1.sample_period = sample_period;
@@ -106,3 +233,16 @@ pub unsafe fn setup_syscall_event(syscall: &str) -> Result<c_int> {
 
     Ok(fd)
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_software_event_names() {
+        for event in SoftwareEvent::ALL {
+            assert_eq!(event.to_string().parse::<SoftwareEvent>(), Ok(event));
+        }
+        assert!("cycles".parse::<SoftwareEvent>().is_err());
+    }
+}
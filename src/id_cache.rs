@@ -0,0 +1,174 @@
+use crate::{ID_COUNTER_MASK, ID_CPU_SHIFT};
+
+pub fn id_cpu(id: u32) -> usize {
+    (id >> ID_CPU_SHIFT) as usize
+}
+
+pub fn id_index(id: u32) -> usize {
+    (id & ID_COUNTER_MASK) as usize
+}
+
+pub fn make_id(cpu: usize, index: u32) -> u32 {
+    ((cpu as u32) << ID_CPU_SHIFT) | (index & ID_COUNTER_MASK)
+}
+
+/// Userspace copy of a BPF map keyed by ids allocated from per-CPU counters
+/// (see `insert_with_new_id`). As the ids are dense on every CPU, they can
+/// be resolved by indexing into a vector per CPU rather than hashing. It's
+/// cleared along with the BPF maps when the ids are recycled, which keeps it
+/// from growing past the ids a CPU can hand out.
+pub struct IdCache<T> {
+    per_cpu: Vec<Vec<Option<T>>>,
+    // Last counter value seen for each CPU.
+    synced: Vec<u32>,
+}
+
+impl<T> Default for IdCache<T> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl<T> IdCache<T> {
+    pub fn new() -> Self {
+        IdCache {
+            per_cpu: Vec::new(),
+            synced: Vec::new(),
+        }
+    }
+
+    pub fn insert(&mut self, id: u32, value: T) {
+        // `make_id` masks the index, so a vector never goes past the last
+        // id of its CPU
+        let (cpu, index) = (id_cpu(id), id_index(id));
+        if self.per_cpu.len() <= cpu {
+            self.per_cpu.resize_with(cpu + 1, Vec::new);
+        }
+        let entries = &mut self.per_cpu[cpu];
+        if entries.len() <= index {
+            entries.resize_with(index + 1, || None);
+        }
+        entries[index] = Some(value);
+    }
+
+    pub fn get(&self, id: u32) -> Option<&T> {
+        self.per_cpu
+            .get(id_cpu(id))
+            .and_then(|entries| entries.get(id_index(id)))
+            .and_then(|entry| entry.as_ref())
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (u32, &T)> {
+        self.per_cpu.iter().enumerate().flat_map(|(cpu, entries)| {
+            entries
+                .iter()
+                .enumerate()
+                .filter_map(move |(index, entry)| {
+                    entry
+                        .as_ref()
+                        .map(|value| (make_id(cpu, index as u32), value))
+                })
+        })
+    }
+
+    pub fn len(&self) -> usize {
+        self.per_cpu
+            .iter()
+            .map(|entries| entries.iter().filter(|e| e.is_some()).count())
+            .sum()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Forgets every entry, for when BPF starts handing out ids from
+    /// scratch.
+    pub fn clear(&mut self) {
+        self.per_cpu.clear();
+        self.synced.clear();
+    }
+
+    /// Returns the ids allocated on `cpu` since the last call, given the
+    /// current value of its counter. Counters only grow until the ids are
+    /// recycled, and the cache cleared.
+    pub fn new_ids(&mut self, cpu: usize, counter: u32) -> Vec<u32> {
+        if self.synced.len() <= cpu {
+            self.synced.resize(cpu + 1, 0);
+        }
+        let last = self.synced[cpu];
+        self.synced[cpu] = self.synced[cpu].max(counter);
+
+        (last + 1..=counter.min(ID_COUNTER_MASK))
+            .map(|i| make_id(cpu, i))
+            .collect()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_id_roundtrip() {
+        let id = make_id(3, 42);
+        assert_eq!(id_cpu(id), 3);
+        assert_eq!(id_index(id), 42);
+    }
+
+    #[test]
+    fn test_insert_and_get() {
+        let mut cache = IdCache::new();
+        cache.insert(make_id(0, 1), "a");
+        cache.insert(make_id(7, 3), "b");
+
+        assert_eq!(cache.get(make_id(0, 1)), Some(&"a"));
+        assert_eq!(cache.get(make_id(7, 3)), Some(&"b"));
+        assert_eq!(cache.get(make_id(7, 2)), None);
+        assert_eq!(cache.get(0), None);
+        assert_eq!(cache.len(), 2);
+        assert_eq!(
+            cache.iter().collect::<Vec<_>>(),
+            vec![(make_id(0, 1), &"a"), (make_id(7, 3), &"b")]
+        );
+    }
+
+    #[test]
+    fn test_new_ids() {
+        let mut cache: IdCache<()> = IdCache::new();
+        assert_eq!(
+            cache.new_ids(1, 3),
+            vec![make_id(1, 1), make_id(1, 2), make_id(1, 3)]
+        );
+        assert_eq!(cache.new_ids(1, 3), vec![]);
+        assert_eq!(cache.new_ids(1, 4), vec![make_id(1, 4)]);
+    }
+
+    #[test]
+    fn test_new_ids_stop_at_the_last_id() {
+        let mut cache: IdCache<()> = IdCache::new();
+        cache.new_ids(0, ID_COUNTER_MASK - 1);
+        assert_eq!(
+            cache.new_ids(0, ID_COUNTER_MASK),
+            vec![make_id(0, ID_COUNTER_MASK)]
+        );
+        assert_eq!(cache.new_ids(0, ID_COUNTER_MASK), vec![]);
+    }
+
+    #[test]
+    fn test_ids_after_the_counter_wraps() {
+        let mut cache = IdCache::new();
+        for id in cache.new_ids(2, ID_COUNTER_MASK) {
+            cache.insert(id, "old");
+        }
+        assert_eq!(cache.len(), ID_COUNTER_MASK as usize);
+
+        // The counter starts from zero again
+        cache.clear();
+        assert!(cache.is_empty());
+        assert_eq!(cache.new_ids(2, 2), vec![make_id(2, 1), make_id(2, 2)]);
+        cache.insert(make_id(2, 1), "new");
+        assert_eq!(cache.get(make_id(2, 1)), Some(&"new"));
+        assert_eq!(cache.get(make_id(2, 3)), None);
+    }
+}
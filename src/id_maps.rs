@@ -0,0 +1,131 @@
+use std::os::raw::{c_int, c_void};
+
+use anyhow::{anyhow, Result};
+use errno::errno;
+
+use crate::id_counter_kind_ID_COUNTER_KINDS;
+
+// The kernel rounds up every CPU's value in per-CPU maps to 8 bytes.
+fn per_cpu_value_size(value_size: usize) -> usize {
+    (value_size + 7) / 8 * 8
+}
+
+/// The BPF maps frames and strings get their ids from, to recycle the ids
+/// once too many were handed out (see `id_generation`). libbpf-rs' maps are
+/// borrowed by the buffers while profiling, so like `ShardRingBuffer` this
+/// uses libbpf directly.
+pub struct IdMaps {
+    generation_fd: c_int,
+    counters_fd: c_int,
+    // The maps from ids to frames and strings and back, and their key size.
+    maps: Vec<(c_int, usize)>,
+    possible_cpus: usize,
+    generation: u32,
+}
+
+impl IdMaps {
+    pub fn new(
+        generation_fd: c_int,
+        counters_fd: c_int,
+        maps: Vec<(c_int, usize)>,
+        possible_cpus: usize,
+    ) -> Self {
+        IdMaps {
+            generation_fd,
+            counters_fd,
+            maps,
+            possible_cpus,
+            generation: 0,
+        }
+    }
+
+    /// The generation of the ids the stacks sent from now on refer to.
+    pub fn generation(&self) -> u32 {
+        self.generation
+    }
+
+    fn set_generation(&mut self, generation: u32) -> Result<()> {
+        let zero: u32 = 0;
+        let ret = unsafe {
+            libbpf_sys::bpf_map_update_elem(
+                self.generation_fd,
+                &zero as *const u32 as *const c_void,
+                &generation as *const u32 as *const c_void,
+                libbpf_sys::BPF_ANY as u64,
+            )
+        };
+        if ret != 0 {
+            return Err(anyhow!(
+                "updating id_generation failed with errno {}",
+                errno()
+            ));
+        }
+        self.generation = generation;
+        Ok(())
+    }
+
+    /// Makes BPF stop walking stacks, so no ids are handed out.
+    pub fn pause(&mut self) -> Result<()> {
+        self.set_generation(self.generation + 1)
+    }
+
+    /// Makes BPF walk stacks again, with ids of a new generation.
+    pub fn resume(&mut self) -> Result<()> {
+        self.set_generation(self.generation + 1)
+    }
+
+    /// Forgets every id, so they are handed out from scratch. BPF has to be
+    /// paused.
+    pub fn clear(&self) -> Result<()> {
+        for &(fd, key_size) in &self.maps {
+            let mut key = vec![0u8; key_size];
+            // Deleting the first key until there are none left, as deleting
+            // while iterating can restart the iteration anyway
+            while unsafe {
+                libbpf_sys::bpf_map_get_next_key(
+                    fd,
+                    std::ptr::null(),
+                    key.as_mut_ptr() as *mut c_void,
+                )
+            } == 0
+            {
+                let ret =
+                    unsafe { libbpf_sys::bpf_map_delete_elem(fd, key.as_ptr() as *const c_void) };
+                if ret != 0 {
+                    return Err(anyhow!("clearing an id map failed with errno {}", errno()));
+                }
+            }
+        }
+
+        let zeroes = vec![0u8; per_cpu_value_size(4) * self.possible_cpus];
+        for kind in 0..id_counter_kind_ID_COUNTER_KINDS {
+            let ret = unsafe {
+                libbpf_sys::bpf_map_update_elem(
+                    self.counters_fd,
+                    &kind as *const u32 as *const c_void,
+                    zeroes.as_ptr() as *const c_void,
+                    libbpf_sys::BPF_ANY as u64,
+                )
+            };
+            if ret != 0 {
+                return Err(anyhow!(
+                    "resetting id_counters failed with errno {}",
+                    errno()
+                ));
+            }
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_per_cpu_value_size() {
+        assert_eq!(per_cpu_value_size(4), 8);
+        assert_eq!(per_cpu_value_size(8), 8);
+        assert_eq!(per_cpu_value_size(12), 16);
+    }
+}
@@ -6,10 +6,18 @@ include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
 pub mod arch;
 pub mod binary;
 pub mod bpf;
+pub mod capture;
+pub mod decode;
 pub mod events;
+pub mod id_cache;
+pub mod id_maps;
 pub mod info;
+pub mod overhead;
 pub mod process;
 pub mod profile;
 pub mod rbperf;
+pub mod ringbuf_shards;
 pub mod ruby_readers;
 pub mod ruby_versions;
+pub mod userspace_walker;
+pub mod watchdog;
@@ -6,12 +6,20 @@ use inferno::flamegraph;
 use nix::unistd::Uid;
 use std::fs;
 use std::fs::File;
+use std::io::BufReader;
 use std::sync::Arc;
+use std::thread;
 
 use anyhow::{anyhow, Result};
+use rbperf::capture::read_capture;
+use rbperf::decode::Decoder;
+use rbperf::events::SoftwareEvent;
 use rbperf::info::info;
+use rbperf::overhead::self_cpu_time_ns;
+use rbperf::process::ProcessInfo;
 use rbperf::profile::Profile;
-use rbperf::rbperf::{Rbperf, RbperfEvent, RbperfOptions};
+use rbperf::rbperf::{Rbperf, RbperfEvent, RbperfOptions, SyscallWeight};
+use rbperf::userspace_walker::{self, StackWalker};
 
 #[derive(Parser, Debug)]
 #[clap(version, about, long_about = None)]
@@ -24,6 +32,7 @@ struct Args {
 enum Command {
     Record(RecordSubcommand),
     Info(InfoSubcommand),
+    Replay(ReplaySubcommand),
 }
 
 #[derive(Parser, Debug)]
@@ -40,14 +49,97 @@ struct RecordSubcommand {
     verbose_libbpf_logging: bool,
     #[clap(long)]
     ringbuf: bool,
+    /// Size of the ring buffer in bytes, a power of two
+    #[clap(long, default_value_t = 512 * 1024)]
+    ringbuf_size: u32,
+    /// Batch ring buffer wakeups, only waking up rbperf once this many bytes are pending
+    #[clap(long)]
+    ringbuf_wakeup_bytes: Option<u64>,
+    /// Shard the ring buffer by CPU into this many buffers, each drained by its own thread.
+    /// Requires --ringbuf
+    #[clap(long, default_value_t = 1)]
+    ringbuf_shards: u32,
+    /// Pages of each per-CPU perf buffer, a power of two
+    #[clap(long, default_value_t = 64)]
+    perf_buffer_pages: usize,
     #[clap(long)]
     disable_pid_race_detector: bool,
+    /// Maximum number of unique frames kept in the BPF maps at any time
+    #[clap(long, default_value_t = 10240)]
+    frame_map_size: u32,
+    /// Maximum number of unique method names and paths kept in the BPF maps at any time
+    #[clap(long, default_value_t = 10240)]
+    string_map_size: u32,
+    /// Report the CPU cost of rbperf, using the kernel's BPF program stats
+    #[clap(long)]
+    overhead_report: bool,
+    /// Percentage of the host's CPU time rbperf may use. Over it, the sample
+    /// period is lengthened or, as a last resort, the events are disabled.
+    /// Only for the cpu and event profiles
+    #[clap(long)]
+    cpu_budget: Option<f64>,
+    /// Fraction of the samples, between 0 and 1, that may be lost because the
+    /// buffers are full. Over it, the sample period is lengthened
+    #[clap(long)]
+    max_loss_ratio: Option<f64>,
+    /// Also write the raw stacks to this file, to be processed again with `rbperf replay`.
+    /// Profiling stops early if the frames and strings outgrow it
+    #[clap(long)]
+    raw_out: Option<String>,
+    /// Walk the Ruby stacks from userspace with process_vm_readv instead of BPF, for hosts
+    /// where BPF isn't available. Only CPU profiles, sampled by wall-clock time
+    #[clap(long)]
+    userspace: bool,
+    /// Stacks sampled per second by the userspace walker
+    #[clap(long, default_value_t = 99)]
+    sample_rate: u32,
+}
+
+#[derive(Parser, Debug)]
+struct ReplaySubcommand {
+    /// Raw capture written by `rbperf record --raw-out`
+    path: String,
 }
 
 #[derive(clap::Subcommand, Debug, PartialEq)]
 enum RecordType {
-    Cpu,
+    Cpu(CpuSubcommand),
+    /// A software event, such as `page-faults` or `context-switches`
+    Event(EventSubcommand),
     Syscall(SycallSubcommand),
+    /// Where threads wait for the GVL, weighted by how long they waited
+    Gvl(GvlSubcommand),
+    /// Where threads wait to run on a CPU, weighted by how long they waited
+    Runqueue(RunqueueSubcommand),
+    /// Garbage collections, weighted by how long they took
+    Gc,
+    /// Where objects are allocated, weighted by the number of allocations
+    Allocation(AllocationSubcommand),
+    /// Calls to a native function, such as `libpq:PQexec`
+    Uprobe(UprobeSubcommand),
+    /// How long calls to a native function take, by the Ruby stack calling it
+    Latency(LatencySubcommand),
+    /// A kernel tracepoint hit by the process, such as `sched:sched_process_fork`
+    Tracepoint(TracepointSubcommand),
+    /// Calls to a kernel function made by the process
+    Kprobe(KprobeSubcommand),
+}
+
+#[derive(Parser, Debug, PartialEq)]
+struct CpuSubcommand {
+    /// Sample every this many CPU cycles, which every stack is weighted by
+    #[clap(long, default_value_t = 99999)]
+    period: u64,
+}
+
+#[derive(Parser, Debug, PartialEq)]
+struct EventSubcommand {
+    /// One of cpu-clock, page-faults, minor-faults, major-faults,
+    /// context-switches or cpu-migrations
+    name: SoftwareEvent,
+    /// Sample one in every this many events
+    #[clap(long, default_value_t = 1000)]
+    period: u64,
 }
 
 #[derive(Parser, Debug, PartialEq)]
@@ -55,6 +147,62 @@ struct SycallSubcommand {
     names: Vec<String>,
     #[clap(short, long)]
     list: bool,
+    /// Weight the calls by `bytes` transferred, an argument of enter_ syscalls
+    /// (`arg0` to `arg5`) or the return value of exit_ ones (`ret`)
+    #[clap(long, default_value = "calls")]
+    weight: String,
+}
+
+#[derive(Parser, Debug, PartialEq)]
+struct GvlSubcommand {
+    /// Ignore waits shorter than this many microseconds, most GVL acquisitions don't wait
+    #[clap(long, default_value_t = 10)]
+    min_wait_us: u64,
+}
+
+#[derive(Parser, Debug, PartialEq)]
+struct RunqueueSubcommand {
+    /// Ignore delays shorter than this many microseconds
+    #[clap(long, default_value_t = 10)]
+    min_delay_us: u64,
+}
+
+#[derive(Parser, Debug, PartialEq)]
+struct AllocationSubcommand {
+    /// Sample one in every this many allocations
+    #[clap(long, default_value_t = 1000)]
+    sample_every: u64,
+}
+
+#[derive(Parser, Debug, PartialEq)]
+struct UprobeSubcommand {
+    /// The function, as `<binary>:<symbol>`. The binary is a file mapped by
+    /// the process, by path or part of its file name
+    target: String,
+    /// Sample one in every this many calls
+    #[clap(long, default_value_t = 1)]
+    sample_every: u64,
+}
+
+#[derive(Parser, Debug, PartialEq)]
+struct LatencySubcommand {
+    /// The function, as `<binary>:<symbol>`, see the uprobe subcommand
+    target: String,
+    /// How many of the slowest stacks in total to print
+    #[clap(long, default_value_t = 10)]
+    top: usize,
+}
+
+#[derive(Parser, Debug, PartialEq)]
+struct TracepointSubcommand {
+    /// The tracepoint, as `<category>:<name>`
+    target: String,
+}
+
+#[derive(Parser, Debug, PartialEq)]
+struct KprobeSubcommand {
+    /// The kernel function, such as `tcp_sendmsg`
+    function: String,
 }
 
 #[derive(Parser, Debug)]
@@ -76,6 +224,107 @@ fn available_syscalls() -> Vec<String> {
     syscalls
 }
 
+// Splits a target such as `<binary>:<symbol>`, as described by `format`.
+fn split_target(target: &str, format: &str) -> Result<(String, String)> {
+    match target.split_once(':') {
+        Some((first, second)) if !first.is_empty() && !second.is_empty() => {
+            Ok((first.to_string(), second.to_string()))
+        }
+        _ => Err(anyhow!("The target {:?} should be {}", target, format)),
+    }
+}
+
+// Prints the stacks with the slowest calls in total, with the innermost
+// frames last as they are the closest to the call.
+fn print_latencies(profile: &Profile, top: usize) {
+    let us = |ns: u64| ns as f64 / 1000.0;
+    println!("Slowest call sites, in microseconds:");
+    for latencies in profile.latencies().iter().take(top) {
+        println!(
+            "  calls: {}, total: {:.1}, p50: {:.1}, p99: {:.1}, max: {:.1}",
+            latencies.count,
+            us(latencies.total),
+            us(latencies.p50),
+            us(latencies.p99),
+            us(latencies.max)
+        );
+        let innermost = latencies.stack.len().saturating_sub(3);
+        for frame in &latencies.stack[innermost..] {
+            println!("    {}", frame);
+        }
+    }
+}
+
+// Writes the flamegraph and the JSON profile, returns the flamegraph's path.
+fn write_profile(profile: &Profile, folded: &str) -> String {
+    let mut options = flamegraph::Options::default();
+    options.count_name = profile.unit().name().to_string();
+    let data = folded.as_bytes();
+    let now: DateTime<Utc> = Utc::now();
+    let name_suffix = now.format("%m%d%Y_%Hh%Mm%Ss");
+
+    let flame_path = format!("rbperf_flame_{}.svg", name_suffix);
+    let f = File::create(&flame_path).unwrap();
+    flamegraph::from_reader(&mut options, data, f).unwrap();
+
+    let serialized = serde_json::to_string(profile).unwrap();
+    fs::write(format!("rbperf_out_{}.json", name_suffix), serialized)
+        .expect("Unable to write file");
+    flame_path
+}
+
+fn record_userspace(record: RecordSubcommand, runnable: Arc<AtomicBool>) -> Result<()> {
+    if !matches!(record.record_type, RecordType::Cpu(_)) {
+        return Err(anyhow!("The userspace walker can only sample CPU profiles"));
+    }
+    if record.sample_rate == 0 {
+        return Err(anyhow!("The sample rate must be at least 1"));
+    }
+
+    let process_info = ProcessInfo::new(record.pid)?;
+    eprintln!("{}", process_info);
+    let walker = StackWalker::new(&process_info)?;
+
+    let duration = std::time::Duration::from_secs(record.duration.unwrap_or(1));
+    let mut profile = Profile::new();
+    let self_cpu = self_cpu_time_ns();
+    let stats = userspace_walker::profile(
+        vec![walker],
+        record.sample_rate,
+        duration,
+        &mut profile,
+        runnable,
+    );
+    let cpu_time = std::time::Duration::from_nanos(self_cpu_time_ns() - self_cpu);
+
+    if stats.samples == 0 {
+        return Err(anyhow!(
+            "No stacks were collected, {} walks failed",
+            stats.total_errors()
+        ));
+    }
+
+    let folded = profile.folded();
+    let flame_path = write_profile(&profile, &folded);
+    println!(
+        "Walked {} stacks with {} errors",
+        stats.samples,
+        stats.total_errors()
+    );
+    if stats.total_errors() > 0 {
+        println!("  read: {}", stats.read_errors);
+        println!("  wrong frame type: {}", stats.wrong_frame_type_errors);
+        println!("  incomplete stack: {}", stats.incomplete_stack_errors);
+    }
+    println!(
+        "Walking took {:?} per stack on average, rbperf used {:?} of CPU time",
+        stats.mean_walk_time(),
+        cpu_time
+    );
+    println!("Flamegraph written to: {}", flame_path);
+    Ok(())
+}
+
 fn main() -> Result<()> {
     env_logger::init();
 
@@ -110,6 +359,10 @@ fn main() -> Result<()> {
             println!("has ringbuf: {}", bpf_feature.has_ringbuf);
             println!("has bpf_loop: {}", bpf_feature.has_bpf_loop);
         }
+        Command::Record(record) if record.userspace => {
+            // Only needs to be allowed to ptrace the process
+            record_userspace(record, runnable)?;
+        }
         Command::Record(record) => {
             if !Uid::current().is_root() {
                 return Err(anyhow!("rbperf requires root to load and run BPF programs"));
@@ -132,55 +385,223 @@ fn main() -> Result<()> {
             };
 
             let event = match record.record_type {
-                RecordType::Cpu => RbperfEvent::Cpu {
-                    sample_period: 99999,
+                RecordType::Cpu(ref cpu_subcommand) => RbperfEvent::Cpu {
+                    sample_period: cpu_subcommand.period,
+                },
+                RecordType::Event(ref event_subcommand) => RbperfEvent::Software {
+                    event: event_subcommand.name,
+                    sample_period: event_subcommand.period,
+                },
+                RecordType::Syscall(ref syscall_subcommand) => RbperfEvent::Syscall {
+                    names: syscall_subcommand.names.clone(),
+                    weight: SyscallWeight::parse(
+                        &syscall_subcommand.weight,
+                        &syscall_subcommand.names,
+                    )?,
+                },
+                RecordType::Gvl(ref gvl_subcommand) => RbperfEvent::Gvl {
+                    min_wait_ns: gvl_subcommand.min_wait_us * 1000,
                 },
-                RecordType::Syscall(ref syscall_subcommand) => {
-                    RbperfEvent::Syscall(syscall_subcommand.names.clone())
+                RecordType::Runqueue(ref runqueue_subcommand) => RbperfEvent::Runqueue {
+                    min_delay_ns: runqueue_subcommand.min_delay_us * 1000,
+                },
+                RecordType::Gc => RbperfEvent::Gc,
+                RecordType::Allocation(ref allocation_subcommand) => RbperfEvent::Allocation {
+                    sample_every: allocation_subcommand.sample_every,
+                },
+                RecordType::Uprobe(ref uprobe_subcommand) => {
+                    let (binary, symbol) =
+                        split_target(&uprobe_subcommand.target, "<binary>:<symbol>")?;
+                    RbperfEvent::Uprobe {
+                        binary,
+                        symbol,
+                        sample_every: uprobe_subcommand.sample_every,
+                    }
+                }
+                RecordType::Latency(ref latency_subcommand) => {
+                    let (binary, symbol) =
+                        split_target(&latency_subcommand.target, "<binary>:<symbol>")?;
+                    RbperfEvent::Latency { binary, symbol }
+                }
+                RecordType::Tracepoint(ref tracepoint_subcommand) => {
+                    let (category, name) =
+                        split_target(&tracepoint_subcommand.target, "<category>:<name>")?;
+                    RbperfEvent::Tracepoint { category, name }
+                }
+                RecordType::Kprobe(ref kprobe_subcommand) => {
+                    RbperfEvent::Kprobe(kprobe_subcommand.function.clone())
                 }
             };
             let options = RbperfOptions {
                 event,
                 verbose_bpf_logging: record.verbose_bpf_logging,
                 use_ringbuf: record.ringbuf,
+                ringbuf_size: record.ringbuf_size,
+                ringbuf_wakeup_bytes: record.ringbuf_wakeup_bytes,
+                ringbuf_shards: record.ringbuf_shards,
+                perf_buffer_pages: record.perf_buffer_pages,
                 verbose_libbpf_logging: record.verbose_libbpf_logging,
                 disable_pid_race_detector: record.disable_pid_race_detector,
+                frame_map_size: record.frame_map_size,
+                string_map_size: record.string_map_size,
+                overhead_report: record.overhead_report,
+                cpu_budget: record.cpu_budget,
+                max_loss_ratio: record.max_loss_ratio,
+                raw_out: record.raw_out,
             };
 
+            options.validate()?;
+            let unit = options.event.weight_unit();
+
             let mut r = Rbperf::new(options);
             r.add_pid(record.pid)?;
 
             let duration = std::time::Duration::from_secs(record.duration.unwrap_or(1));
-            let mut profile = Profile::new();
+            let mut profile = Profile::with_unit(unit);
             let stats = r.start(duration, &mut profile, runnable)?;
             let folded = profile.folded();
 
             if stats.total_events == 0 {
                 match record.record_type {
-                    RecordType::Cpu => {
+                    RecordType::Cpu(_) => {
                         return Err(anyhow!("No stacks were collected. This might mean that this process is mostly IO bound. If you believe that this might be a bug, please open an issue at https://github.com/javierhonduco/rbperf. Thanks!"));
                     }
+                    RecordType::Event(_) => {
+                        return Err(anyhow!("No stacks were collected. Perhaps the process caused fewer events than --period. If you believe that this might be a bug, please open an issue at https://github.com/javierhonduco/rbperf. Thanks!"));
+                    }
                     RecordType::Syscall(_) => {
                         return Err(anyhow!("No stacks were collected. Perhaps this syscall is never called. If you believe that this might be a bug, please open an issue at https://github.com/javierhonduco/rbperf. Thanks!"));
                     }
+                    RecordType::Gvl(_) => {
+                        return Err(anyhow!("No stacks were collected. Perhaps no thread waited for the GVL for longer than --min-wait-us. If you believe that this might be a bug, please open an issue at https://github.com/javierhonduco/rbperf. Thanks!"));
+                    }
+                    RecordType::Runqueue(_) => {
+                        return Err(anyhow!("No stacks were collected. Perhaps no thread waited to run for longer than --min-delay-us. If you believe that this might be a bug, please open an issue at https://github.com/javierhonduco/rbperf. Thanks!"));
+                    }
+                    RecordType::Gc => {
+                        return Err(anyhow!("No stacks were collected. Perhaps the process didn't run the GC. If you believe that this might be a bug, please open an issue at https://github.com/javierhonduco/rbperf. Thanks!"));
+                    }
+                    RecordType::Allocation(_) => {
+                        return Err(anyhow!("No stacks were collected. Perhaps the process allocated fewer objects than --sample-every. If you believe that this might be a bug, please open an issue at https://github.com/javierhonduco/rbperf. Thanks!"));
+                    }
+                    RecordType::Uprobe(_) | RecordType::Latency(_) => {
+                        return Err(anyhow!("No stacks were collected. Perhaps the function wasn't called, or only by threads that haven't taken the GVL since recording started. If you believe that this might be a bug, please open an issue at https://github.com/javierhonduco/rbperf. Thanks!"));
+                    }
+                    RecordType::Tracepoint(_) | RecordType::Kprobe(_) => {
+                        return Err(anyhow!("No stacks were collected. Perhaps the process never hit this event. If you believe that this might be a bug, please open an issue at https://github.com/javierhonduco/rbperf. Thanks!"));
+                    }
                 }
             }
 
-            let mut options = flamegraph::Options::default();
-            let data = folded.as_bytes();
-            let now: DateTime<Utc> = Utc::now();
-            let name_suffix = now.format("%m%d%Y_%Hh%Mm%Ss");
+            let flame_path = write_profile(&profile, &folded);
 
-            let flame_path = format!("rbperf_flame_{}.svg", name_suffix);
-            let f = File::create(&flame_path).unwrap();
-            flamegraph::from_reader(&mut options, data, f).unwrap();
+            println!(
+                "Got {} samples and {} errors",
+                stats.total_events,
+                stats.total_errors()
+            );
+            if stats.unresolved_string_errors > 0 {
+                println!(
+                    "{} samples have a method name or path that couldn't be resolved",
+                    stats.unresolved_string_errors
+                );
+            }
+            if stats.frame_count_mismatch_errors > 0 {
+                println!(
+                    "{} samples were dropped as some of their frames couldn't be resolved",
+                    stats.frame_count_mismatch_errors
+                );
+            }
+            if let RecordType::Cpu(_) = record.record_type {
+                if stats.gc_events > 0 {
+                    println!(
+                        "{} samples ({:.2}%) were taken during garbage collection",
+                        stats.gc_events,
+                        100.0 * stats.gc_events as f64 / stats.total_events as f64
+                    );
+                }
+            }
+            println!(
+                "BPF saw {} samples, emitted {} and had {} errors",
+                stats.bpf_samples_seen,
+                stats.bpf_samples_emitted,
+                stats.total_bpf_errors()
+            );
+            if stats.total_bpf_errors() > 0 {
+                println!("  read string: {}", stats.bpf_read_string_errors);
+                println!("  wrong frame type: {}", stats.bpf_wrong_frame_type_errors);
+                println!(
+                    "  stack size mismatch: {}",
+                    stats.bpf_stack_size_mismatch_errors
+                );
+                println!(
+                    "  missing version offsets: {}",
+                    stats.bpf_missing_version_offsets_errors
+                );
+                println!(
+                    "  pid start time mismatch: {}",
+                    stats.bpf_pid_start_time_mismatch_errors
+                );
+                println!("  id insert: {}", stats.bpf_id_insert_errors);
+                println!("  ids exhausted: {}", stats.bpf_ids_exhausted_errors);
+                println!(
+                    "  dropped while recycling ids: {}",
+                    stats.bpf_id_recycling_drops
+                );
+                println!(
+                    "  buffer full: {} ({:.2}% of the samples)",
+                    stats.bpf_output_errors,
+                    stats.loss_ratio() * 100.0
+                );
+                let busiest = stats
+                    .bpf_output_errors_per_cpu
+                    .iter()
+                    .enumerate()
+                    .max_by_key(|(_, errors)| **errors);
+                if let Some((cpu, errors)) = busiest.filter(|(_, errors)| **errors > 0) {
+                    println!("  buffer full, most on CPU {}: {}", cpu, errors);
+                }
+            }
+            if stats.id_recycles > 0 {
+                println!(
+                    "The frame and string ids were recycled {} times, {} stacks arrived too late to be decoded",
+                    stats.id_recycles, stats.stale_stack_errors
+                );
+            }
+            if stats.watchdog_throttles + stats.watchdog_disables > 0 {
+                println!(
+                    "The CPU budget or loss ratio was exceeded: throttled {} times, disabled {} times, restored {} times",
+                    stats.watchdog_throttles, stats.watchdog_disables, stats.watchdog_restores
+                );
+                if let Some(sample_period) = stats.final_sample_period {
+                    println!("Final sample period: {}", sample_period);
+                }
+            }
+            if let RecordType::Latency(ref latency_subcommand) = record.record_type {
+                println!();
+                print_latencies(&profile, latency_subcommand.top);
+            }
+            if let Some(overhead) = &stats.overhead {
+                println!();
+                print!("{}", overhead);
+                println!();
+            }
+            println!("Flamegraph written to: {}", flame_path);
+        }
+        Command::Replay(replay) => {
+            let mut reader = BufReader::new(File::open(&replay.path)?);
+            let capture = read_capture(&mut reader)?;
 
-            let serialized = serde_json::to_string(&profile).unwrap();
-            fs::write(format!("rbperf_out_{}.json", name_suffix), serialized)
-                .expect("Unable to write file");
+            let decoder = Decoder::new(&capture.frames, &capture.strings, capture.syscall_frames);
+            let workers = thread::available_parallelism().map_or(1, |n| n.get());
+            let (decoded, stats) = decoder.decode_all(&capture.stacks, workers);
+            let mut profile = Profile::with_unit(capture.unit);
+            profile.merge(decoded);
+            let folded = profile.folded();
 
+            let flame_path = write_profile(&profile, &folded);
             println!(
-                "Got {} samples and {} errors",
+                "Replayed {} samples with {} errors",
                 stats.total_events,
                 stats.total_errors()
             );
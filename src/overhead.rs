@@ -0,0 +1,348 @@
+use std::fmt;
+use std::fs;
+use std::os::raw::c_void;
+use std::time::{Duration, Instant};
+
+use anyhow::{anyhow, Result};
+use errno::errno;
+use proc_maps::Pid;
+
+/// Keeps the kernel's BPF program runtime stats enabled while alive.
+pub struct BpfStatsGuard {
+    fd: i32,
+}
+
+impl BpfStatsGuard {
+    pub fn new() -> Result<Self> {
+        let fd = unsafe { libbpf_sys::bpf_enable_stats(libbpf_sys::BPF_STATS_RUN_TIME) };
+        if fd < 0 {
+            return Err(anyhow!(
+                "enabling BPF stats failed with errno {}, this requires Linux 5.8+",
+                errno()
+            ));
+        }
+        Ok(BpfStatsGuard { fd })
+    }
+}
+
+impl Drop for BpfStatsGuard {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.fd) };
+    }
+}
+
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct ProgramRunStats {
+    pub run_time_ns: u64,
+    pub run_count: u64,
+}
+
+impl ProgramRunStats {
+    /// Cumulative stats for the program, as kept by the kernel since
+    /// stats were enabled.
+    pub fn read(prog_fd: i32) -> Result<Self> {
+        let mut info: libbpf_sys::bpf_prog_info = unsafe { std::mem::zeroed() };
+        let mut len = std::mem::size_of::<libbpf_sys::bpf_prog_info>() as u32;
+        let ret = unsafe {
+            libbpf_sys::bpf_obj_get_info_by_fd(
+                prog_fd,
+                &mut info as *mut libbpf_sys::bpf_prog_info as *mut c_void,
+                &mut len,
+            )
+        };
+        if ret != 0 {
+            return Err(anyhow!(
+                "bpf_obj_get_info_by_fd failed with errno {}",
+                errno()
+            ));
+        }
+        Ok(ProgramRunStats {
+            run_time_ns: info.run_time_ns,
+            run_count: info.run_cnt,
+        })
+    }
+
+    fn delta(&self, previous: &ProgramRunStats) -> ProgramRunStats {
+        ProgramRunStats {
+            run_time_ns: self.run_time_ns.saturating_sub(previous.run_time_ns),
+            run_count: self.run_count.saturating_sub(previous.run_count),
+        }
+    }
+}
+
+/// CPU time used by a process, user and system, in nanoseconds.
+pub fn process_cpu_time_ns(pid: Pid) -> Result<u64> {
+    let stat = fs::read_to_string(format!("/proc/{}/stat", pid))?;
+    // The command name can contain spaces, skip past it.
+    let fields: Vec<&str> = stat
+        .rsplit_once(')')
+        .ok_or_else(|| anyhow!("malformed /proc/{}/stat", pid))?
+        .1
+        .split_whitespace()
+        .collect();
+    // utime and stime are the 14th and 15th fields, the first two (pid
+    // and comm) have been skipped.
+    let utime: u64 = fields
+        .get(11)
+        .ok_or_else(|| anyhow!("missing utime"))?
+        .parse()?;
+    let stime: u64 = fields
+        .get(12)
+        .ok_or_else(|| anyhow!("missing stime"))?
+        .parse()?;
+    let ticks_per_second = unsafe { libc::sysconf(libc::_SC_CLK_TCK) } as u64;
+    Ok((utime + stime) * 1_000_000_000 / ticks_per_second)
+}
+
+/// CPU time used by rbperf itself, user and system, in nanoseconds.
+pub fn self_cpu_time_ns() -> u64 {
+    let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+    unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) };
+    let to_ns = |t: libc::timeval| t.tv_sec as u64 * 1_000_000_000 + t.tv_usec as u64 * 1_000;
+    to_ns(usage.ru_utime) + to_ns(usage.ru_stime)
+}
+
+/// Nearest-rank percentile of `values`, which doesn't need to be sorted.
+pub fn percentile(values: &[f64], p: f64) -> f64 {
+    if values.is_empty() {
+        return 0.0;
+    }
+    let mut sorted = values.to_vec();
+    sorted.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    let rank = ((p / 100.0) * sorted.len() as f64).ceil() as usize;
+    sorted[rank.clamp(1, sorted.len()) - 1]
+}
+
+#[derive(Debug, Clone)]
+pub struct ProgramOverhead {
+    pub name: String,
+    pub stats: ProgramRunStats,
+}
+
+#[derive(Debug, Clone, Default)]
+pub struct OverheadReport {
+    pub duration: Duration,
+    pub programs: Vec<ProgramOverhead>,
+    pub samples_emitted: u64,
+    // Mean cost of a run of the entry program, over the whole session
+    // and at the 99th percentile of the per-interval means.
+    pub mean_ns_per_run: f64,
+    pub p99_ns_per_run: f64,
+    pub bpf_cpu_ns: u64,
+    pub userspace_cpu_ns: u64,
+    pub target_cpu_ns: u64,
+    pub online_cpus: usize,
+}
+
+impl OverheadReport {
+    pub fn ns_per_sample(&self) -> f64 {
+        if self.samples_emitted == 0 {
+            return 0.0;
+        }
+        self.bpf_cpu_ns as f64 / self.samples_emitted as f64
+    }
+
+    pub fn profiler_cpu_ns(&self) -> u64 {
+        self.bpf_cpu_ns + self.userspace_cpu_ns
+    }
+
+    /// Profiler CPU time as a percentage of the target's CPU time.
+    pub fn target_cpu_percent(&self) -> f64 {
+        if self.target_cpu_ns == 0 {
+            return 0.0;
+        }
+        self.profiler_cpu_ns() as f64 * 100.0 / self.target_cpu_ns as f64
+    }
+
+    /// Profiler CPU time as a percentage of all the host's CPUs.
+    pub fn host_cpu_percent(&self) -> f64 {
+        let available = self.duration.as_nanos() as f64 * self.online_cpus as f64;
+        if available == 0.0 {
+            return 0.0;
+        }
+        self.profiler_cpu_ns() as f64 * 100.0 / available
+    }
+}
+
+impl fmt::Display for OverheadReport {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        writeln!(f, "Overhead report")?;
+        writeln!(f, "---------------")?;
+        for program in &self.programs {
+            writeln!(
+                f,
+                "{}: {} runs, {:.3} ms total",
+                program.name,
+                program.stats.run_count,
+                program.stats.run_time_ns as f64 / 1e6
+            )?;
+        }
+        writeln!(
+            f,
+            "cost per run: mean {:.0} ns, p99 {:.0} ns",
+            self.mean_ns_per_run, self.p99_ns_per_run
+        )?;
+        writeln!(f, "cost per emitted sample: {:.0} ns", self.ns_per_sample())?;
+        writeln!(
+            f,
+            "profiler CPU: {:.3} ms (BPF {:.3} ms, userspace {:.3} ms)",
+            self.profiler_cpu_ns() as f64 / 1e6,
+            self.bpf_cpu_ns as f64 / 1e6,
+            self.userspace_cpu_ns as f64 / 1e6
+        )?;
+        writeln!(
+            f,
+            "profiler CPU / target CPU: {:.3}% ({:.3} ms of target CPU)",
+            self.target_cpu_percent(),
+            self.target_cpu_ns as f64 / 1e6
+        )?;
+        writeln!(
+            f,
+            "profiler CPU / host CPU: {:.4}% ({} CPUs)",
+            self.host_cpu_percent(),
+            self.online_cpus
+        )?;
+        Ok(())
+    }
+}
+
+/// Collects BPF program stats while profiling.
+///
+/// The kernel only keeps cumulative counters, so to approximate the
+/// distribution of the cost of each run we take the mean of every
+/// interval between calls to `sample`.
+pub struct OverheadTracker {
+    programs: Vec<(String, i32)>,
+    pids: Vec<Pid>,
+    started_at: Instant,
+    start_programs: Vec<ProgramRunStats>,
+    last_programs: Vec<ProgramRunStats>,
+    start_target_cpu_ns: u64,
+    start_self_cpu_ns: u64,
+    interval_means: Vec<f64>,
+}
+
+impl OverheadTracker {
+    /// `programs` are (name, fd) pairs. The first one is the entry program
+    /// that walks the stack, which accounts for the runtime of every program it tail calls into,
+    /// as the kernel doesn't account tail calls separately.
+    pub fn new(programs: Vec<(String, i32)>, pids: Vec<Pid>) -> Result<Self> {
+        let start_programs = programs
+            .iter()
+            .map(|(_, fd)| ProgramRunStats::read(*fd))
+            .collect::<Result<Vec<_>>>()?;
+        Ok(OverheadTracker {
+            start_target_cpu_ns: Self::target_cpu_ns(&pids),
+            start_self_cpu_ns: self_cpu_time_ns(),
+            last_programs: start_programs.clone(),
+            start_programs,
+            programs,
+            pids,
+            started_at: Instant::now(),
+            interval_means: Vec::new(),
+        })
+    }
+
+    fn target_cpu_ns(pids: &[Pid]) -> u64 {
+        pids.iter()
+            .filter_map(|pid| process_cpu_time_ns(*pid).ok())
+            .sum()
+    }
+
+    fn read_programs(&self) -> Vec<ProgramRunStats> {
+        self.programs
+            .iter()
+            .zip(self.last_programs.iter())
+            .map(|((_, fd), last)| ProgramRunStats::read(*fd).unwrap_or(*last))
+            .collect()
+    }
+
+    /// Returns the BPF runtime since the previous call.
+    pub fn sample(&mut self) -> ProgramRunStats {
+        let current = self.read_programs();
+        let delta = current[0].delta(&self.last_programs[0]);
+        if delta.run_count > 0 {
+            self.interval_means
+                .push(delta.run_time_ns as f64 / delta.run_count as f64);
+        }
+        self.last_programs = current;
+        delta
+    }
+
+    pub fn report(&mut self, samples_emitted: u64) -> OverheadReport {
+        self.sample();
+
+        let programs: Vec<ProgramOverhead> = self
+            .programs
+            .iter()
+            .zip(self.last_programs.iter().zip(self.start_programs.iter()))
+            .map(|((name, _), (last, start))| ProgramOverhead {
+                name: name.clone(),
+                stats: last.delta(start),
+            })
+            .collect();
+        let entry = programs[0].stats;
+        let mean_ns_per_run = if entry.run_count > 0 {
+            entry.run_time_ns as f64 / entry.run_count as f64
+        } else {
+            0.0
+        };
+
+        OverheadReport {
+            duration: self.started_at.elapsed(),
+            samples_emitted,
+            mean_ns_per_run,
+            p99_ns_per_run: percentile(&self.interval_means, 99.0),
+            bpf_cpu_ns: programs.iter().map(|p| p.stats.run_time_ns).sum(),
+            userspace_cpu_ns: self_cpu_time_ns().saturating_sub(self.start_self_cpu_ns),
+            target_cpu_ns: Self::target_cpu_ns(&self.pids).saturating_sub(self.start_target_cpu_ns),
+            online_cpus: num_online_cpus(),
+            programs,
+        }
+    }
+}
+
+pub fn num_online_cpus() -> usize {
+    let cpus = unsafe { libc::sysconf(libc::_SC_NPROCESSORS_ONLN) };
+    if cpus < 1 {
+        1
+    } else {
+        cpus as usize
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_percentile() {
+        let values: Vec<f64> = (1..=100).map(|v| v as f64).collect();
+        assert_eq!(percentile(&values, 50.0), 50.0);
+        assert_eq!(percentile(&values, 99.0), 99.0);
+        assert_eq!(percentile(&values, 100.0), 100.0);
+        assert_eq!(percentile(&[3.0, 1.0, 2.0], 99.0), 3.0);
+        assert_eq!(percentile(&[], 99.0), 0.0);
+    }
+
+    #[test]
+    fn test_report_percentages() {
+        let report = OverheadReport {
+            duration: Duration::from_secs(1),
+            samples_emitted: 1000,
+            bpf_cpu_ns: 5_000_000,
+            userspace_cpu_ns: 5_000_000,
+            target_cpu_ns: 1_000_000_000,
+            online_cpus: 4,
+            ..Default::default()
+        };
+        assert_eq!(report.ns_per_sample(), 5000.0);
+        assert_eq!(report.target_cpu_percent(), 1.0);
+        assert_eq!(report.host_cpu_percent(), 0.25);
+    }
+
+    #[test]
+    fn test_process_cpu_time_ns() {
+        assert!(process_cpu_time_ns(std::process::id() as Pid).is_ok());
+    }
+}
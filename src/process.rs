@@ -1,5 +1,5 @@
 use std::fmt;
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 
 use anyhow::anyhow;
 use log::debug;
@@ -25,6 +25,9 @@ pub struct ProcessInfo {
     pub ruby_vm_ptr_address: u64,
     pub process_base_address: u64,
     pub libruby: Option<LibrubyInfo>,
+    // The binary with the Ruby VM, libruby or the executable, as seen from
+    // outside of the process' mount namespace.
+    pub binary_path: PathBuf,
 }
 
 impl fmt::Display for ProcessInfo {
@@ -71,25 +74,41 @@ fn find_libruby(pid: Pid) -> Result<Option<LibrubyInfo>, ProcessError> {
     Ok(None)
 }
 
+// Path of `path` in the mount namespace of `pid`, as seen from outside of it.
+fn in_process_root(pid: Pid, path: &Path) -> PathBuf {
+    let mut root_path = PathBuf::new();
+    root_path.push("/proc/");
+    root_path.push(pid.to_string());
+    root_path.push("root");
+    root_path.push(path.strip_prefix("/").expect("remove prefix"));
+    root_path
+}
+
+/// Finds the file mapped by `pid` at `name`, or whose file name contains
+/// `name`, such as `libpq` for `/usr/lib/libpq.so.5`. The path returned is
+/// seen from outside of the process' mount namespace.
+pub fn find_mapped_file(pid: Pid, name: &str) -> Result<PathBuf, anyhow::Error> {
+    let maps = get_process_maps(pid).map_err(|_| ProcessError::ProcessDoesNotExist { pid })?;
+    maps.iter()
+        .filter_map(|map| map.filename())
+        .find(|path| {
+            *path == Path::new(name)
+                || path.file_name().map_or(false, |file_name| {
+                    file_name.to_string_lossy().contains(name)
+                })
+        })
+        .map(|path| in_process_root(pid, path))
+        .ok_or_else(|| anyhow!("no file matching {:?} is mapped by pid {}", name, pid))
+}
+
 impl ProcessInfo {
     pub fn new(pid: Pid) -> Result<Self, anyhow::Error> {
         let libruby = find_libruby(pid as Pid)?;
 
-        let mut bin_path = PathBuf::new();
-        bin_path.push("/proc/");
-        bin_path.push(pid.to_string());
-
-        if let Some(l) = &libruby {
-            bin_path.push("root");
-            bin_path.push(
-                l.executable
-                    .clone()
-                    .strip_prefix("/")
-                    .expect("remove prefix"),
-            )
-        } else {
-            bin_path.push("exe");
-        }
+        let bin_path = match &libruby {
+            Some(l) => in_process_root(pid, &l.executable),
+            None => PathBuf::from(format!("/proc/{}/exe", pid)),
+        };
 
         let ruby_version = ruby_version(&bin_path).unwrap();
 
@@ -108,6 +127,7 @@ impl ProcessInfo {
             ruby_vm_ptr_address: symbol.address,
             process_base_address: base_address,
             libruby,
+            binary_path: bin_path,
         })
     }
 
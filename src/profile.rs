@@ -1,27 +1,102 @@
 use proc_maps::Pid;
 use serde::{Deserialize, Serialize};
-use std::collections::HashMap;
+use std::collections::{BTreeMap, HashMap};
 use std::convert::TryInto;
 use std::fmt::Write;
 
-#[derive(Serialize, Deserialize, Debug)]
+// Weights below 2^HISTOGRAM_SUB_BITS have a bucket each, larger ones are
+// split in this many buckets per power of two, which bounds the error of
+// the percentiles to under 1%.
+const HISTOGRAM_SUB_BITS: u32 = 7;
+
+/// What the sample weights are.
+#[derive(Serialize, Deserialize, Clone, Copy, Debug, PartialEq, Eq)]
+pub enum WeightUnit {
+    Count,
+    Nanoseconds,
+    Bytes,
+    Pages,
+    Cycles,
+}
+
+impl WeightUnit {
+    /// What the weights are called in the outputs, such as the flamegraph.
+    pub fn name(&self) -> &'static str {
+        match self {
+            WeightUnit::Count => "samples",
+            WeightUnit::Nanoseconds => "ns",
+            WeightUnit::Bytes => "bytes",
+            WeightUnit::Pages => "pages",
+            WeightUnit::Cycles => "cycles",
+        }
+    }
+}
+
+#[derive(Serialize, Deserialize, Clone, Copy, Debug, PartialEq, Eq, Hash)]
 struct Frame {
     method_idx: usize,
     file_idx: usize,
 }
 
+// The samples with the same stack, process and command.
 #[derive(Serialize, Deserialize, Debug)]
 struct Sample {
     stack: Vec<Frame>,
     comm: String, // this could be interned, too
     pid: Pid,
+    // How many samples were aggregated.
+    count: u64,
+    // The sum of what the samples count for, such as nanoseconds waited.
+    weight: u64,
+    max: u64,
+    // Bucket to count of the weights, see `histogram_bucket`.
+    histogram: BTreeMap<u32, u64>,
+}
+
+type SampleKey = (Pid, String, Vec<Frame>);
+
+// Log-linear bucket of `weight`.
+fn histogram_bucket(weight: u64) -> u32 {
+    let exponent = 63 - weight.max(1).leading_zeros();
+    if exponent < HISTOGRAM_SUB_BITS {
+        return weight as u32;
+    }
+    let shift = exponent - HISTOGRAM_SUB_BITS;
+    ((shift + 1) << HISTOGRAM_SUB_BITS)
+        + ((weight >> shift) as u32 & ((1 << HISTOGRAM_SUB_BITS) - 1))
+}
+
+// The largest weight in `bucket`.
+fn histogram_bucket_max(bucket: u32) -> u64 {
+    if bucket < (1 << HISTOGRAM_SUB_BITS) {
+        return bucket as u64;
+    }
+    let shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    let mantissa = (1 << HISTOGRAM_SUB_BITS) + (bucket as u64 & ((1 << HISTOGRAM_SUB_BITS) - 1));
+    (mantissa << shift) + ((1 << shift) - 1)
+}
+
+/// How the weights of the samples of a stack, such as call durations, are
+/// distributed.
+#[derive(Debug, PartialEq, Eq)]
+pub struct StackLatencies {
+    // From the root to the leaf, as in `folded`.
+    pub stack: Vec<String>,
+    pub count: usize,
+    pub total: u64,
+    pub p50: u64,
+    pub p99: u64,
+    pub max: u64,
 }
 
 #[derive(Serialize, Deserialize, Debug)]
 pub struct Profile {
     #[serde(skip)]
     symbol_id_map: HashMap<String, u32>,
+    #[serde(skip)]
+    sample_id_map: HashMap<SampleKey, usize>,
     symbols: Vec<String>,
+    unit: WeightUnit,
     samples: Vec<Sample>,
 }
 
@@ -33,27 +108,99 @@ impl Default for Profile {
 
 impl Profile {
     pub fn new() -> Self {
+        Self::with_unit(WeightUnit::Count)
+    }
+
+    pub fn with_unit(unit: WeightUnit) -> Self {
         Profile {
             symbol_id_map: HashMap::new(),
+            sample_id_map: HashMap::new(),
             symbols: Vec::new(),
+            unit,
             samples: Vec::new(),
         }
     }
 
+    pub fn unit(&self) -> WeightUnit {
+        self.unit
+    }
+
     pub fn add_sample(&mut self, pid: Pid, comm: String, stack: Vec<(String, String)>) {
-        let mut sample = Sample {
-            stack: Vec::new(),
-            comm,
-            pid,
-        };
+        self.add_weighted_sample(pid, comm, stack, 1);
+    }
 
-        for (method, path) in stack {
-            sample.stack.push(Frame {
+    pub fn add_weighted_sample(
+        &mut self,
+        pid: Pid,
+        comm: String,
+        stack: Vec<(String, String)>,
+        weight: u64,
+    ) {
+        let frames = stack
+            .into_iter()
+            .map(|(method, path)| Frame {
                 method_idx: self.index_for(method),
                 file_idx: self.index_for(path),
-            });
+            })
+            .collect();
+        let sample = self.sample_for((pid, comm, frames));
+        sample.count += 1;
+        sample.weight += weight;
+        sample.max = sample.max.max(weight);
+        *sample
+            .histogram
+            .entry(histogram_bucket(weight))
+            .or_default() += 1;
+    }
+
+    /// Adds the samples of `other`, which has its own symbol table. The
+    /// unit of this profile is kept.
+    pub fn merge(&mut self, other: Profile) {
+        let remap: Vec<usize> = other
+            .symbols
+            .into_iter()
+            .map(|symbol| self.index_for(symbol))
+            .collect();
+        for other_sample in other.samples {
+            let frames = other_sample
+                .stack
+                .iter()
+                .map(|frame| Frame {
+                    method_idx: remap[frame.method_idx],
+                    file_idx: remap[frame.file_idx],
+                })
+                .collect();
+            let sample = self.sample_for((other_sample.pid, other_sample.comm, frames));
+            sample.count += other_sample.count;
+            sample.weight += other_sample.weight;
+            sample.max = sample.max.max(other_sample.max);
+            for (bucket, count) in other_sample.histogram {
+                *sample.histogram.entry(bucket).or_default() += count;
+            }
         }
-        self.samples.push(sample);
+    }
+
+    // The aggregated sample for `key`, empty if it's new.
+    fn sample_for(&mut self, key: SampleKey) -> &mut Sample {
+        let idx = match self.sample_id_map.get(&key) {
+            Some(idx) => *idx,
+            None => {
+                let idx = self.samples.len();
+                let (pid, comm, stack) = key.clone();
+                self.samples.push(Sample {
+                    stack,
+                    comm,
+                    pid,
+                    count: 0,
+                    weight: 0,
+                    max: 0,
+                    histogram: BTreeMap::new(),
+                });
+                self.sample_id_map.insert(key, idx);
+                idx
+            }
+        };
+        &mut self.samples[idx]
     }
 
     fn index_for(&mut self, name: String) -> usize {
@@ -69,22 +216,73 @@ impl Profile {
         }
     }
 
-    pub fn folded(&self) -> String {
-        let mut sample_count = HashMap::new();
-        for sample in &self.samples {
-            let mut stack = Vec::new();
-            for frame in sample.stack.iter().rev() {
+    fn stack_names(&self, sample: &Sample) -> Vec<String> {
+        sample
+            .stack
+            .iter()
+            .rev()
+            .map(|frame| {
                 let method_name = &self.symbols[frame.method_idx];
                 let path = &self.symbols[frame.file_idx];
+                format!("{method_name} - {path}")
+            })
+            .collect()
+    }
 
-                stack.push(format!("{method_name} - {path}"));
+    /// The distribution of the sample weights of every stack, the stacks
+    /// with the highest total first. Percentiles are the upper bound of
+    /// their histogram bucket.
+    pub fn latencies(&self) -> Vec<StackLatencies> {
+        let mut by_stack: HashMap<Vec<String>, (u64, u64, u64, BTreeMap<u32, u64>)> =
+            HashMap::new();
+        for sample in &self.samples {
+            let (count, total, max, histogram) =
+                by_stack.entry(self.stack_names(sample)).or_default();
+            *count += sample.count;
+            *total += sample.weight;
+            *max = (*max).max(sample.max);
+            for (bucket, bucket_count) in &sample.histogram {
+                *histogram.entry(*bucket).or_default() += bucket_count;
             }
+        }
+
+        // Nearest-rank percentile of the histogram
+        let percentile = |histogram: &BTreeMap<u32, u64>, count: u64, max: u64, p: f64| {
+            let rank = ((p * count as f64).ceil() as u64).max(1);
+            let mut seen = 0;
+            for (bucket, bucket_count) in histogram {
+                seen += bucket_count;
+                if seen >= rank {
+                    return histogram_bucket_max(*bucket).min(max);
+                }
+            }
+            max
+        };
+        let mut latencies: Vec<StackLatencies> = by_stack
+            .into_iter()
+            .map(|(stack, (count, total, max, histogram))| StackLatencies {
+                stack,
+                count: count as usize,
+                total,
+                p50: percentile(&histogram, count, max, 0.5),
+                p99: percentile(&histogram, count, max, 0.99),
+                max,
+            })
+            .collect();
+        latencies.sort_by(|a, b| b.total.cmp(&a.total).then_with(|| a.stack.cmp(&b.stack)));
+        latencies
+    }
+
+    pub fn folded(&self) -> String {
+        let mut sample_count = HashMap::new();
+        for sample in &self.samples {
+            let stack = self.stack_names(sample);
 
             // https://www.reddit.com/r/rust/comments/2xjhli/best_way_to_increment_counter_in_a_map/
             match sample_count.get_mut(&stack) {
-                Some(count) => *count += 1,
+                Some(count) => *count += sample.weight,
                 None => {
-                    sample_count.insert(stack.clone(), 1);
+                    sample_count.insert(stack.clone(), sample.weight);
                 }
             };
         }
@@ -102,3 +300,102 @@ impl Profile {
         result
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn frames(names: &[&str]) -> Vec<(String, String)> {
+        names
+            .iter()
+            .map(|name| (name.to_string(), "file.rb".to_string()))
+            .collect()
+    }
+
+    #[test]
+    fn test_merge_remaps_symbols() {
+        let mut profile = Profile::new();
+        profile.add_sample(1, "ruby".to_string(), frames(&["a", "b"]));
+
+        let mut other = Profile::new();
+        other.add_sample(2, "ruby".to_string(), frames(&["c", "b"]));
+        other.add_sample(2, "ruby".to_string(), frames(&["a", "b"]));
+
+        profile.merge(other);
+
+        assert_eq!(profile.symbols, vec!["a", "file.rb", "b", "c"]);
+        let mut folded: Vec<&str> = Vec::new();
+        let result = profile.folded();
+        folded.extend(result.lines());
+        folded.sort();
+        assert_eq!(
+            folded,
+            vec!["b - file.rb;a - file.rb 2", "b - file.rb;c - file.rb 1"]
+        );
+    }
+
+    #[test]
+    fn test_folded_sums_weights() {
+        let mut profile = Profile::new();
+        profile.add_weighted_sample(1, "ruby".to_string(), frames(&["a", "b"]), 1500);
+        profile.add_weighted_sample(1, "ruby".to_string(), frames(&["a", "b"]), 500);
+
+        assert_eq!(profile.folded(), "b - file.rb;a - file.rb 2000\n");
+    }
+
+    #[test]
+    fn test_add_sample_aggregates() {
+        let mut profile = Profile::with_unit(WeightUnit::Bytes);
+        profile.add_weighted_sample(1, "ruby".to_string(), frames(&["a", "b"]), 4096);
+        profile.add_weighted_sample(1, "ruby".to_string(), frames(&["a", "b"]), 100);
+        profile.add_weighted_sample(2, "ruby".to_string(), frames(&["a", "b"]), 1);
+
+        assert_eq!(profile.unit(), WeightUnit::Bytes);
+        assert_eq!(profile.unit().name(), "bytes");
+        assert_eq!(profile.samples.len(), 2);
+        assert_eq!(profile.samples[0].count, 2);
+        assert_eq!(profile.samples[0].weight, 4196);
+        assert_eq!(profile.folded(), "b - file.rb;a - file.rb 4197\n");
+    }
+
+    #[test]
+    fn test_histogram_buckets() {
+        for weight in [0, 1, 127, 128, 129, 1000, 123_456_789, u64::MAX] {
+            let bucket_max = histogram_bucket_max(histogram_bucket(weight));
+            assert!(bucket_max >= weight);
+            assert!(bucket_max - weight <= weight / 128);
+        }
+    }
+
+    #[test]
+    fn test_latencies() {
+        let mut profile = Profile::new();
+        for weight in 1..=100 {
+            profile.add_weighted_sample(1, "ruby".to_string(), frames(&["query", "a"]), weight);
+        }
+        profile.add_weighted_sample(1, "ruby".to_string(), frames(&["query", "b"]), 20);
+
+        let latencies = profile.latencies();
+        assert_eq!(
+            latencies,
+            vec![
+                StackLatencies {
+                    stack: vec!["a - file.rb".to_string(), "query - file.rb".to_string()],
+                    count: 100,
+                    total: 5050,
+                    p50: 50,
+                    p99: 99,
+                    max: 100,
+                },
+                StackLatencies {
+                    stack: vec!["b - file.rb".to_string(), "query - file.rb".to_string()],
+                    count: 1,
+                    total: 20,
+                    p50: 20,
+                    p99: 20,
+                    max: 20,
+                },
+            ]
+        );
+    }
+}
@@ -1,34 +1,346 @@
-use core::sync::atomic::{AtomicBool, Ordering};
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use libbpf_rs::{num_possible_cpus, MapFlags, MapType, PerfBufferBuilder, ProgramType};
 use serde_yaml;
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::PathBuf;
 use std::sync::mpsc::channel;
 use std::sync::{Arc, Mutex};
+use std::thread;
 use std::time::Duration;
 use std::time::Instant;
 
-use anyhow::Result;
+use anyhow::{anyhow, Result};
 use log::{debug, error, info};
 use proc_maps::Pid;
-use syscalls;
 
 use crate::arch;
-use crate::bpf::rbperf::{rbperf_rodata_types::rbperf_event_type, RbperfSkel, RbperfSkelBuilder};
-use crate::events::{setup_perf_event, setup_syscall_event};
-use crate::process::ProcessInfo;
-use crate::profile::Profile;
-use crate::ruby_readers::{any_as_u8_slice, parse_frame, parse_stack, str_from_u8_nul};
-use crate::ruby_versions::{
-    ruby_2_6_0, ruby_2_6_3, ruby_2_7_1, ruby_2_7_4, ruby_2_7_6, ruby_3_0_0, ruby_3_0_4, ruby_3_1_2,
+use crate::binary::function_file_offset;
+use crate::bpf::rbperf::{
+    rbperf_rodata_types::rbperf_event_type, RbperfMaps, RbperfSkel, RbperfSkelBuilder,
+};
+use crate::capture::write_capture;
+use crate::decode::Decoder;
+use crate::events::{
+    enable_event, set_sample_period, setup_perf_event, setup_software_event, setup_syscall_event,
+    setup_tracepoint_event, SoftwareEvent,
 };
+use crate::id_cache::IdCache;
+use crate::id_maps::IdMaps;
+use crate::overhead::{
+    num_online_cpus, self_cpu_time_ns, BpfStatsGuard, OverheadReport, OverheadTracker,
+    ProgramRunStats,
+};
+use crate::process::{find_mapped_file, ProcessInfo};
+use crate::profile::{Profile, WeightUnit};
+use crate::ringbuf_shards::{shard_map_name, ShardConsumers};
+use crate::ruby_readers::{any_as_u8_slice, parse_frame, parse_stack, str_from_u8_nul};
+use crate::ruby_versions::ruby_version_configs;
+use crate::watchdog::{Watchdog, WatchdogAction};
 use crate::RubyVersionOffsets;
 use crate::{
-    ruby_stack_status_STACK_INCOMPLETE, ProcessData, RubyStack, RBPERF_STACK_READING_PROGRAM_IDX,
+    id_counter_kind, id_counter_kind_FRAME_ID_COUNTER, id_counter_kind_STRING_ID_COUNTER,
+    rbperf_stat, rbperf_stat_STAT_IDS_EXHAUSTED_ERRORS, rbperf_stat_STAT_ID_INSERT_ERRORS,
+    rbperf_stat_STAT_ID_RECYCLING_DROPS, rbperf_stat_STAT_MISSING_VERSION_OFFSETS_ERRORS,
+    rbperf_stat_STAT_OUTPUT_ERRORS, rbperf_stat_STAT_PID_START_TIME_MISMATCH_ERRORS,
+    rbperf_stat_STAT_READ_STRING_ERRORS, rbperf_stat_STAT_SAMPLES_EMITTED,
+    rbperf_stat_STAT_SAMPLES_SEEN, rbperf_stat_STAT_STACK_SIZE_MISMATCH_ERRORS,
+    rbperf_stat_STAT_WRONG_FRAME_TYPE_ERRORS, ProcessData, RubyFrame, RubyStack, ID_COUNTER_MASK,
+    MAX_RINGBUF_SHARDS, RBPERF_STACK_READING_PROGRAM_IDX,
 };
 
+// The frame and string ids are recycled once a CPU handed out this many of
+// either, which leaves plenty for the time it takes to notice.
+const ID_RECYCLING_THRESHOLD: u32 = ID_COUNTER_MASK / 2;
+// Given to the stacks being walked to finish before recycling the ids.
+const ID_RECYCLING_GRACE_PERIOD: Duration = Duration::from_millis(10);
+
+// Where threads wait for the GVL, in every supported Ruby version.
+const GVL_ACQUIRE_FUNCTION: &str = "gvl_acquire_common";
+// Where every GC starts, in every supported Ruby version.
+const GC_START_FUNCTION: &str = "gc_start";
+// The entry points to allocate Ruby objects. `newobj_of`, which they all
+// call, is inlined. Not all of them exist in every version.
+const ALLOCATION_FUNCTIONS: [&str; 4] = [
+    "rb_wb_protected_newobj_of",
+    "rb_wb_unprotected_newobj_of",
+    "rb_ec_wb_protected_newobj_of",
+    "rb_newobj_of",
+];
+
+// The kernel function that runs in the thread switched in. Usually not
+// inlined, but renamed by the compiler.
+const TASK_SWITCH_IN_FUNCTIONS: [&str; 2] = ["finish_task_switch.isra.0", "finish_task_switch"];
+const TASK_WAKEUP_FUNCTIONS: [&str; 2] = ["try_to_wake_up", "wake_up_new_task"];
+
+// An entry program attached to a function with a uprobe.
+struct Uprobe {
+    // The file mapped by the process the function is in, see
+    // `find_mapped_file`. The binary with the Ruby VM when unset.
+    binary: Option<String>,
+    function: String,
+    program: &'static str,
+    retprobe: bool,
+}
+
+// Syscalls whose third argument is the number of bytes they transfer.
+const BYTE_COUNT_SYSCALLS: [&str; 6] =
+    ["read", "write", "pread64", "pwrite64", "sendto", "recvfrom"];
+
+/// What syscall samples are weighted by, and in which unit.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum SyscallWeight {
+    Calls,
+    // The argument at this index, in `enter_` syscalls.
+    Arg(u8, WeightUnit),
+    // The return value, in `exit_` syscalls.
+    Ret(WeightUnit),
+}
+
+impl SyscallWeight {
+    /// Parses `calls`, `arg<N>`, `ret` or `bytes`, the bytes transferred by
+    /// `syscall_names`: the return value of `exit_` syscalls, or the length
+    /// argument of `enter_` ones, such as `enter_write`.
+    pub fn parse(spec: &str, syscall_names: &[String]) -> Result<Self> {
+        match spec {
+            "calls" => Ok(SyscallWeight::Calls),
+            "ret" => Ok(SyscallWeight::Ret(WeightUnit::Count)),
+            "bytes" => {
+                if syscall_names.iter().all(|name| name.starts_with("exit_")) {
+                    Ok(SyscallWeight::Ret(WeightUnit::Bytes))
+                } else if syscall_names.iter().all(|name| {
+                    name.strip_prefix("enter_")
+                        .map_or(false, |syscall| BYTE_COUNT_SYSCALLS.contains(&syscall))
+                }) {
+                    Ok(SyscallWeight::Arg(2, WeightUnit::Bytes))
+                } else {
+                    Err(anyhow!(
+                        "can only weight by bytes exit_ syscalls, or enter_ syscalls of {}",
+                        BYTE_COUNT_SYSCALLS.join(", ")
+                    ))
+                }
+            }
+            _ => spec
+                .strip_prefix("arg")
+                .and_then(|index| index.parse().ok())
+                .map(|index| SyscallWeight::Arg(index, WeightUnit::Count))
+                .ok_or_else(|| anyhow!("unknown syscall weight {:?}", spec)),
+        }
+    }
+
+    // The 8 byte field after the syscall number read by BPF, see
+    // `syscall_weight_field`.
+    fn field(&self) -> i32 {
+        match self {
+            SyscallWeight::Calls => -1,
+            SyscallWeight::Arg(index, _) => *index as i32,
+            SyscallWeight::Ret(_) => 0,
+        }
+    }
+
+    fn unit(&self) -> WeightUnit {
+        match self {
+            SyscallWeight::Calls => WeightUnit::Count,
+            SyscallWeight::Arg(_, unit) | SyscallWeight::Ret(unit) => *unit,
+        }
+    }
+}
+
 #[derive(Clone)]
 pub enum RbperfEvent {
-    Cpu { sample_period: u64 },
-    Syscall(Vec<String>),
+    Cpu {
+        sample_period: u64,
+    },
+    // One in every `sample_period` occurrences of a software event, such as
+    // page faults, on any CPU.
+    Software {
+        event: SoftwareEvent,
+        sample_period: u64,
+    },
+    Syscall {
+        names: Vec<String>,
+        weight: SyscallWeight,
+    },
+    // Threads waiting for the GVL for at least `min_wait_ns`.
+    Gvl {
+        min_wait_ns: u64,
+    },
+    // Threads waiting in the run queue for at least `min_delay_ns`.
+    Runqueue {
+        min_delay_ns: u64,
+    },
+    // Garbage collections, with the stack that triggered them.
+    Gc,
+    // One in every `sample_every` object allocations.
+    Allocation {
+        sample_every: u64,
+    },
+    // One in every `sample_every` calls to `symbol` in `binary`, see
+    // `Uprobe`.
+    Uprobe {
+        binary: String,
+        symbol: String,
+        sample_every: u64,
+    },
+    // Calls to `symbol` in `binary`, weighted by how long they took.
+    Latency {
+        binary: String,
+        symbol: String,
+    },
+    // The kernel tracepoint `category:name`, hit by the profiled process.
+    Tracepoint {
+        category: String,
+        name: String,
+    },
+    // Calls to a kernel function made by the profiled process.
+    Kprobe(String),
+}
+
+impl RbperfEvent {
+    // The programs the event is attached to, the stack is walked by
+    // `walk_ruby_stack` for all of them.
+    fn entry_programs(&self) -> &'static [&'static str] {
+        match self {
+            RbperfEvent::Cpu { .. }
+            | RbperfEvent::Software { .. }
+            | RbperfEvent::Syscall { .. }
+            | RbperfEvent::Tracepoint { .. }
+            | RbperfEvent::Kprobe(_) => &["on_event"],
+            RbperfEvent::Gvl { .. } => &["on_gvl_wait", "on_gvl_acquired"],
+            RbperfEvent::Runqueue { .. } => &["on_task_wakeup", "on_task_switch_in"],
+            RbperfEvent::Gc | RbperfEvent::Latency { .. } => &["on_call_start", "on_call_done"],
+            RbperfEvent::Allocation { .. } | RbperfEvent::Uprobe { .. } => &["on_uprobe"],
+        }
+    }
+
+    // The entry program that tail calls into `walk_ruby_stack`, the others
+    // only record state for it.
+    fn walking_program(&self) -> &'static str {
+        match self {
+            RbperfEvent::Gvl { .. } => "on_gvl_acquired",
+            RbperfEvent::Runqueue { .. } => "on_task_switch_in",
+            RbperfEvent::Gc | RbperfEvent::Latency { .. } => "on_call_done",
+            _ => self.entry_programs()[0],
+        }
+    }
+
+    // The uprobes the entry programs are attached with, if any.
+    fn uprobes(&self) -> Vec<Uprobe> {
+        let entry_and_return = |binary: Option<&String>, function: &str, entry, exit| {
+            vec![
+                Uprobe {
+                    binary: binary.cloned(),
+                    function: function.to_string(),
+                    program: entry,
+                    retprobe: false,
+                },
+                Uprobe {
+                    binary: binary.cloned(),
+                    function: function.to_string(),
+                    program: exit,
+                    retprobe: true,
+                },
+            ]
+        };
+        match self {
+            RbperfEvent::Cpu { .. }
+            | RbperfEvent::Software { .. }
+            | RbperfEvent::Syscall { .. }
+            | RbperfEvent::Tracepoint { .. }
+            | RbperfEvent::Kprobe(_)
+            | RbperfEvent::Runqueue { .. } => Vec::new(),
+            RbperfEvent::Gvl { .. } => {
+                entry_and_return(None, GVL_ACQUIRE_FUNCTION, "on_gvl_wait", "on_gvl_acquired")
+            }
+            RbperfEvent::Gc => {
+                entry_and_return(None, GC_START_FUNCTION, "on_call_start", "on_call_done")
+            }
+            RbperfEvent::Latency { binary, symbol } => {
+                entry_and_return(Some(binary), symbol, "on_call_start", "on_call_done")
+            }
+            RbperfEvent::Allocation { .. } => ALLOCATION_FUNCTIONS
+                .iter()
+                .map(|function| Uprobe {
+                    binary: None,
+                    function: function.to_string(),
+                    program: "on_uprobe",
+                    retprobe: false,
+                })
+                .collect(),
+            RbperfEvent::Uprobe { binary, symbol, .. } => vec![Uprobe {
+                binary: Some(binary.clone()),
+                function: symbol.clone(),
+                program: "on_uprobe",
+                retprobe: false,
+            }],
+        }
+    }
+
+    // Whether the stacks are walked on the thread the event happens on,
+    // which can be any Ruby thread, see `on_ruby_thread`.
+    fn walks_current_thread(&self) -> bool {
+        matches!(
+            self,
+            RbperfEvent::Gc
+                | RbperfEvent::Latency { .. }
+                | RbperfEvent::Allocation { .. }
+                | RbperfEvent::Uprobe { .. }
+                | RbperfEvent::Runqueue { .. }
+                | RbperfEvent::Tracepoint { .. }
+                | RbperfEvent::Kprobe(_)
+                | RbperfEvent::Software { .. }
+        )
+    }
+
+    // Whether every uprobe has to be attached. Entry and return probes only
+    // work in pairs, while the allocation functions differ across Ruby
+    // versions and any of them is enough.
+    fn needs_every_uprobe(&self) -> bool {
+        !matches!(self, RbperfEvent::Allocation { .. })
+    }
+
+    /// What the weights of the samples are. Software events are weighted by
+    /// their period, which for the CPU clock is in nanoseconds.
+    pub fn weight_unit(&self) -> WeightUnit {
+        match self {
+            RbperfEvent::Software { event, .. } => match event {
+                SoftwareEvent::CpuClock => WeightUnit::Nanoseconds,
+                SoftwareEvent::PageFaults
+                | SoftwareEvent::MinorFaults
+                | SoftwareEvent::MajorFaults => WeightUnit::Pages,
+                SoftwareEvent::ContextSwitches | SoftwareEvent::CpuMigrations => WeightUnit::Count,
+            },
+            RbperfEvent::Syscall { weight, .. } => weight.unit(),
+            RbperfEvent::Gvl { .. }
+            | RbperfEvent::Runqueue { .. }
+            | RbperfEvent::Gc
+            | RbperfEvent::Latency { .. } => WeightUnit::Nanoseconds,
+            RbperfEvent::Cpu { .. } => WeightUnit::Cycles,
+            RbperfEvent::Allocation { .. }
+            | RbperfEvent::Uprobe { .. }
+            | RbperfEvent::Tracepoint { .. }
+            | RbperfEvent::Kprobe(_) => WeightUnit::Count,
+        }
+    }
+
+    // The period of the events sampled by the perf events, which the
+    // watchdog can raise.
+    fn sample_period(&self) -> Option<u64> {
+        match self {
+            RbperfEvent::Cpu { sample_period } | RbperfEvent::Software { sample_period, .. } => {
+                Some(*sample_period)
+            }
+            _ => None,
+        }
+    }
+
+    fn set_sample_period(&mut self, period: u64) {
+        if let RbperfEvent::Cpu { sample_period } | RbperfEvent::Software { sample_period, .. } =
+            self
+        {
+            *sample_period = period;
+        }
+    }
 }
 
 impl From<RbperfEvent> for rbperf_event_type {
@@ -37,7 +349,16 @@ impl From<RbperfEvent> for rbperf_event_type {
             RbperfEvent::Cpu { sample_period: _ } => {
                 rbperf_event_type::RBPERF_EVENT_ON_CPU_SAMPLING
             }
-            RbperfEvent::Syscall(_) => rbperf_event_type::RBPERF_EVENT_SYSCALL,
+            RbperfEvent::Software { .. } => rbperf_event_type::RBPERF_EVENT_SOFTWARE,
+            RbperfEvent::Syscall { .. } => rbperf_event_type::RBPERF_EVENT_SYSCALL,
+            RbperfEvent::Gvl { .. } => rbperf_event_type::RBPERF_EVENT_GVL,
+            RbperfEvent::Runqueue { .. } => rbperf_event_type::RBPERF_EVENT_RUNQUEUE,
+            RbperfEvent::Gc => rbperf_event_type::RBPERF_EVENT_GC,
+            RbperfEvent::Allocation { .. } => rbperf_event_type::RBPERF_EVENT_ALLOCATION,
+            RbperfEvent::Uprobe { .. } => rbperf_event_type::RBPERF_EVENT_UPROBE,
+            RbperfEvent::Latency { .. } => rbperf_event_type::RBPERF_EVENT_LATENCY,
+            RbperfEvent::Tracepoint { .. } => rbperf_event_type::RBPERF_EVENT_TRACEPOINT,
+            RbperfEvent::Kprobe(_) => rbperf_event_type::RBPERF_EVENT_KPROBE,
         }
     }
 }
@@ -51,37 +372,289 @@ pub struct Rbperf<'a> {
     ruby_versions: Vec<RubyVersion>,
     event: RbperfEvent,
     use_ringbuf: bool,
+    ringbuf_shards: u32,
+    perf_buffer_pages: usize,
+    overhead_report: bool,
+    cpu_budget: Option<f64>,
+    max_loss_ratio: Option<f64>,
+    raw_out: Option<String>,
+    pids: Vec<Pid>,
+    // The binaries with the Ruby VM of every process, to attach the
+    // uprobes to.
+    binaries: Vec<(Pid, PathBuf)>,
+    frames: IdCache<RubyFrame>,
+    strings: IdCache<String>,
+    // The generation of the ids in `frames` and `strings`.
+    id_generation: u32,
     pub stats: Stats,
 }
 
-#[derive(Default, Clone)]
+#[derive(Default, Clone, Debug)]
 pub struct Stats {
     pub total_events: u32,
     // Events discarded due to the kernel buffer being full.
-    pub lost_event_errors: u32,
+    pub lost_event_errors: u64,
+    // Lost events reported by the perf buffer, by CPU.
+    pub lost_events_per_cpu: Vec<u64>,
     // Failed to retrieve sample due to a failed read from a map.
     pub map_reading_errors: u32,
     // The stack is not complete, it is truncated
     pub incomplete_stack_errors: u32,
+    // A method name or path couldn't be resolved, the sample was kept.
+    pub unresolved_string_errors: u32,
+    // Fewer frames than the stack's size were resolved, the sample was
+    // dropped. The frame that couldn't be is a map reading error too.
+    pub frame_count_mismatch_errors: u32,
     // How many times have we bumped into garbled data.
     pub garbled_data_errors: u32,
+    // Samples taken during a garbage collection.
+    pub gc_events: u32,
+    // Times the frame and string ids were handed out from scratch.
+    pub id_recycles: u32,
+    // Stacks received after the ids they refer to were recycled.
+    pub stale_stack_errors: u32,
+    // Counters kept in BPF, see `rbperf_stat`.
+    //
+    // Events from profiled processes that BPF started reading a stack for.
+    pub bpf_samples_seen: u64,
+    // Stacks successfully written to the perf/ring buffer.
+    pub bpf_samples_emitted: u64,
+    // Failed to read a method name or path from the process.
+    pub bpf_read_string_errors: u64,
+    // A frame's path had an unexpected Ruby type.
+    pub bpf_wrong_frame_type_errors: u64,
+    // Read a different number of frames than the stack had.
+    pub bpf_stack_size_mismatch_errors: u64,
+    // No offsets configured for the process' Ruby version.
+    pub bpf_missing_version_offsets_errors: u64,
+    // The pid was reused by another process.
+    pub bpf_pid_start_time_mismatch_errors: u64,
+    // A frame or string could not be stored in the BPF maps.
+    pub bpf_id_insert_errors: u64,
+    // Frames or strings that couldn't get an id, as all were handed out.
+    pub bpf_ids_exhausted_errors: u64,
+    // Stacks not walked or dropped while the ids were recycled.
+    pub bpf_id_recycling_drops: u64,
+    // Stacks that couldn't be written as the perf/ring buffer was full.
+    pub bpf_output_errors: u64,
+    pub bpf_output_errors_per_cpu: Vec<u64>,
+    // Only set when the overhead report was requested.
+    pub overhead: Option<OverheadReport>,
+    // Times the watchdog lengthened the sample period or disabled the
+    // events because rbperf went over its CPU budget or lost too many
+    // samples.
+    pub watchdog_throttles: u32,
+    pub watchdog_disables: u32,
+    // Times the watchdog shortened the sample period or re-enabled the
+    // events once rbperf was back under its limits.
+    pub watchdog_restores: u32,
+    // Sample period in use when profiling finished.
+    pub final_sample_period: Option<u64>,
 }
 
 impl Stats {
-    pub fn total_errors(&self) -> u32 {
+    pub fn total_errors(&self) -> u64 {
         self.lost_event_errors
-            + self.map_reading_errors
-            + self.incomplete_stack_errors
-            + self.garbled_data_errors
+            + (self.map_reading_errors
+                + self.incomplete_stack_errors
+                + self.unresolved_string_errors
+                + self.garbled_data_errors
+                + self.stale_stack_errors) as u64
+    }
+
+    pub fn total_bpf_errors(&self) -> u64 {
+        self.bpf_read_string_errors
+            + self.bpf_wrong_frame_type_errors
+            + self.bpf_stack_size_mismatch_errors
+            + self.bpf_missing_version_offsets_errors
+            + self.bpf_pid_start_time_mismatch_errors
+            + self.bpf_id_insert_errors
+            + self.bpf_ids_exhausted_errors
+            + self.bpf_id_recycling_drops
+            + self.bpf_output_errors
+    }
+
+    /// Fraction of the stacks that couldn't be written to the buffer.
+    pub fn loss_ratio(&self) -> f64 {
+        loss_ratio(self.bpf_samples_emitted, self.bpf_output_errors)
+    }
+
+    // Sum the per-CPU BPF counters into these stats.
+    fn read_bpf_stats(&mut self, bpf_stats: &libbpf_rs::Map) {
+        let read_per_cpu = |stat: rbperf_stat| -> Vec<u64> {
+            match bpf_stats.lookup_percpu(&stat.to_le_bytes(), MapFlags::ANY) {
+                Ok(Some(values)) => values
+                    .iter()
+                    .map(|value| u64::from_le_bytes(value[..8].try_into().unwrap()))
+                    .collect(),
+                Ok(None) => Vec::new(),
+                Err(err) => {
+                    debug!("Reading bpf_stats failed with {:?}", err);
+                    Vec::new()
+                }
+            }
+        };
+        let read = |stat: rbperf_stat| -> u64 { read_per_cpu(stat).iter().sum() };
+
+        self.bpf_samples_seen = read(rbperf_stat_STAT_SAMPLES_SEEN);
+        self.bpf_samples_emitted = read(rbperf_stat_STAT_SAMPLES_EMITTED);
+        self.bpf_read_string_errors = read(rbperf_stat_STAT_READ_STRING_ERRORS);
+        self.bpf_wrong_frame_type_errors = read(rbperf_stat_STAT_WRONG_FRAME_TYPE_ERRORS);
+        self.bpf_stack_size_mismatch_errors = read(rbperf_stat_STAT_STACK_SIZE_MISMATCH_ERRORS);
+        self.bpf_missing_version_offsets_errors =
+            read(rbperf_stat_STAT_MISSING_VERSION_OFFSETS_ERRORS);
+        self.bpf_pid_start_time_mismatch_errors =
+            read(rbperf_stat_STAT_PID_START_TIME_MISMATCH_ERRORS);
+        self.bpf_id_insert_errors = read(rbperf_stat_STAT_ID_INSERT_ERRORS);
+        self.bpf_ids_exhausted_errors = read(rbperf_stat_STAT_IDS_EXHAUSTED_ERRORS);
+        self.bpf_id_recycling_drops = read(rbperf_stat_STAT_ID_RECYCLING_DROPS);
+        self.bpf_output_errors_per_cpu = read_per_cpu(rbperf_stat_STAT_OUTPUT_ERRORS);
+        self.bpf_output_errors = self.bpf_output_errors_per_cpu.iter().sum();
+    }
+}
+
+fn loss_ratio(emitted: u64, lost: u64) -> f64 {
+    if emitted + lost == 0 {
+        return 0.0;
     }
+    lost as f64 / (emitted + lost) as f64
 }
 
 pub struct RbperfOptions {
     pub event: RbperfEvent,
     pub verbose_bpf_logging: bool,
     pub use_ringbuf: bool,
+    // Size of the ring buffer in bytes, a power of two multiple of the
+    // page size.
+    pub ringbuf_size: u32,
+    // Only wake up the ring buffer consumer once this many bytes are
+    // pending rather than on every sample.
+    pub ringbuf_wakeup_bytes: Option<u64>,
+    // Number of ring buffers the samples are sharded into by CPU, each
+    // one drained by its own thread.
+    pub ringbuf_shards: u32,
+    // Pages of each per-CPU perf buffer, a power of two.
+    pub perf_buffer_pages: usize,
     pub verbose_libbpf_logging: bool,
     pub disable_pid_race_detector: bool,
+    // Maximum number of entries in each of the BPF frame maps.
+    pub frame_map_size: u32,
+    // Maximum number of entries in each of the BPF string maps.
+    pub string_map_size: u32,
+    // Measure the cost of the BPF programs with the kernel's BPF stats.
+    pub overhead_report: bool,
+    // Percentage of the host's CPU time rbperf may use before the
+    // watchdog throttles the events.
+    pub cpu_budget: Option<f64>,
+    // Fraction of the samples that may be lost because the buffers are
+    // full before the watchdog throttles the events.
+    pub max_loss_ratio: Option<f64>,
+    // Write the raw stacks, frames and strings to this file so they can
+    // be replayed later.
+    pub raw_out: Option<String>,
+}
+
+impl RbperfOptions {
+    pub fn validate(&self) -> Result<()> {
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u32;
+        if !self.ringbuf_size.is_power_of_two() || self.ringbuf_size < page_size {
+            return Err(anyhow!(
+                "the ring buffer size must be a power of two and at least {} bytes",
+                page_size
+            ));
+        }
+        if let Some(wakeup_bytes) = self.ringbuf_wakeup_bytes {
+            if wakeup_bytes == 0 || wakeup_bytes > self.ringbuf_size.into() {
+                return Err(anyhow!(
+                    "the wakeup threshold must be between 1 and the ring buffer size"
+                ));
+            }
+        }
+        if !(1..=MAX_RINGBUF_SHARDS).contains(&self.ringbuf_shards) {
+            return Err(anyhow!(
+                "the number of ring buffer shards must be between 1 and {}",
+                MAX_RINGBUF_SHARDS
+            ));
+        }
+        if self.ringbuf_shards > 1 && !self.use_ringbuf {
+            return Err(anyhow!(
+                "the ring buffer can only be sharded when it is used"
+            ));
+        }
+        if let Some(max_loss_ratio) = self.max_loss_ratio {
+            if !(0.0..1.0).contains(&max_loss_ratio) {
+                return Err(anyhow!("the maximum loss ratio must be between 0 and 1"));
+            }
+        }
+        // The watchdog lengthens the sample period or disables the perf
+        // events. Disabling a tracepoint's perf event doesn't stop the BPF
+        // programs attached to it, so syscalls and tracepoints can't be
+        // throttled
+        if self.cpu_budget.is_some() && self.event.sample_period().is_none() {
+            return Err(anyhow!(
+                "the CPU budget can only be enforced on events with a sample period"
+            ));
+        }
+        // Losing events is only worth disabling them over when their
+        // period can be lengthened first
+        if self.max_loss_ratio.is_some() && self.event.sample_period().is_none() {
+            return Err(anyhow!(
+                "the loss ratio can only be enforced on events with a sample period"
+            ));
+        }
+        if let RbperfEvent::Allocation { sample_every: 0 }
+        | RbperfEvent::Uprobe {
+            sample_every: 0, ..
+        } = self.event
+        {
+            return Err(anyhow!("uprobes must be sampled at least one in every 1"));
+        }
+        if let RbperfEvent::Syscall { names, weight } = &self.event {
+            let prefix = match weight {
+                SyscallWeight::Calls => "",
+                SyscallWeight::Arg(..) => "enter_",
+                SyscallWeight::Ret(_) => "exit_",
+            };
+            if let Some(name) = names.iter().find(|name| !name.starts_with(prefix)) {
+                return Err(anyhow!(
+                    "can't weight {} by {:?}, arguments are only read on enter_ syscalls and return values on exit_ ones",
+                    name,
+                    weight
+                ));
+            }
+            if matches!(weight, SyscallWeight::Arg(index, _) if *index >= 6) {
+                return Err(anyhow!("syscalls have up to 6 arguments"));
+            }
+        }
+        if !self.perf_buffer_pages.is_power_of_two() {
+            return Err(anyhow!("the perf buffer pages must be a power of two"));
+        }
+        Ok(())
+    }
+}
+
+impl Default for RbperfOptions {
+    fn default() -> Self {
+        RbperfOptions {
+            event: RbperfEvent::Cpu {
+                sample_period: 99999,
+            },
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            ringbuf_size: 512 * 1024,
+            ringbuf_wakeup_bytes: None,
+            ringbuf_shards: 1,
+            perf_buffer_pages: 64,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            frame_map_size: 10240,
+            string_map_size: 10240,
+            overhead_report: false,
+            cpu_budget: None,
+            max_loss_ratio: None,
+            raw_out: None,
+        }
+    }
 }
 
 fn handle_event(
@@ -98,6 +671,112 @@ fn handle_lost_events(cpu: i32, count: u64) {
     error!("Lost {} events on CPU {}", count, cpu);
 }
 
+// Copy the entries inserted in BPF since the last call into `cache`. Only
+// the ids below each CPU's counter have to be looked up. Returns the highest
+// counter.
+fn sync_ids<T>(
+    counters: &libbpf_rs::Map,
+    counter_kind: id_counter_kind,
+    map: &libbpf_rs::Map,
+    cache: &mut IdCache<T>,
+    parse: impl Fn(&[u8]) -> Option<T>,
+) -> u32 {
+    let counters = match counters.lookup_percpu(&counter_kind.to_le_bytes(), MapFlags::ANY) {
+        Ok(Some(counters)) => counters,
+        Ok(None) => return 0,
+        Err(err) => {
+            debug!("Reading id_counters failed with {:?}", err);
+            return 0;
+        }
+    };
+
+    let mut highest_counter = 0;
+    for (cpu, counter) in counters.iter().enumerate() {
+        let counter = u32::from_le_bytes(counter[..4].try_into().unwrap());
+        highest_counter = highest_counter.max(counter);
+        for id in cache.new_ids(cpu, counter) {
+            match map.lookup(&id.to_le_bytes(), MapFlags::ANY) {
+                Ok(Some(bytes)) => match parse(&bytes) {
+                    Some(value) => cache.insert(id, value),
+                    None => debug!("Id {} in {} is garbled", id, map.name()),
+                },
+                // Evicted before we could copy it.
+                Ok(None) => debug!("Id {} not found in {}", id, map.name()),
+                Err(err) => {
+                    debug!("Reading from {} failed with {:?}", map.name(), err);
+                }
+            }
+        }
+    }
+    highest_counter
+}
+
+// Copy the frames and strings created since the last call. This runs
+// periodically while profiling so they are copied before they can be
+// evicted from the BPF maps. Returns the most ids a CPU handed out.
+fn sync_frames(
+    maps: &RbperfMaps,
+    frames: &mut IdCache<RubyFrame>,
+    strings: &mut IdCache<String>,
+) -> u32 {
+    let string_ids = sync_ids(
+        maps.id_counters(),
+        id_counter_kind_STRING_ID_COUNTER,
+        maps.id_to_string(),
+        strings,
+        |bytes| {
+            unsafe { str_from_u8_nul(bytes) }
+                .ok()
+                .map(|s| s.to_string())
+        },
+    );
+    let frame_ids = sync_ids(
+        maps.id_counters(),
+        id_counter_kind_FRAME_ID_COUNTER,
+        maps.id_to_stack(),
+        frames,
+        |bytes| Some(unsafe { parse_frame(bytes) }),
+    );
+    string_ids.max(frame_ids)
+}
+
+// Only keeps the stacks whose frame ids are of `generation`, returns how many
+// were dropped.
+fn retain_generation(stacks: &mut Vec<RubyStack>, generation: u32) -> u32 {
+    let received = stacks.len();
+    stacks.retain(|stack| stack.id_generation == generation);
+    (received - stacks.len()) as u32
+}
+
+// Decodes the stacks received so far into `profile`. They are dropped if
+// the ids they refer to were recycled since.
+fn decode_received(
+    receiver: &Mutex<std::sync::mpsc::Receiver<RubyStack>>,
+    frames: &IdCache<RubyFrame>,
+    strings: &IdCache<String>,
+    id_generation: u32,
+    syscall_frames: bool,
+    profile: &mut Profile,
+    stats: &mut Stats,
+) -> Vec<RubyStack> {
+    let mut stacks: Vec<RubyStack> = receiver.lock().unwrap().try_iter().collect();
+    stats.stale_stack_errors += retain_generation(&mut stacks, id_generation);
+
+    let workers = thread::available_parallelism().map_or(1, |n| n.get());
+    let decoder = Decoder::new(frames, strings, syscall_frames);
+    let (decoded, decode_stats) = decoder.decode_all(&stacks, workers);
+    profile.merge(decoded);
+
+    stats.total_events += decode_stats.total_events;
+    stats.map_reading_errors += decode_stats.map_reading_errors;
+    stats.incomplete_stack_errors += decode_stats.incomplete_stack_errors;
+    stats.unresolved_string_errors += decode_stats.unresolved_string_errors;
+    stats.frame_count_mismatch_errors += decode_stats.frame_count_mismatch_errors;
+    stats.garbled_data_errors += decode_stats.garbled_data_errors;
+    stats.gc_events += decode_stats.gc_events;
+    stacks
+}
+
 #[derive(Debug)]
 pub struct RubyVersion {
     major_version: i32,
@@ -122,12 +801,8 @@ impl<'a> Rbperf<'a> {
 
     pub fn setup_ruby_version_config(versions: &mut libbpf_rs::Map) -> Result<Vec<RubyVersion>> {
         // Set the Ruby versions config
-        let ruby_version_configs_raw = vec![
-            ruby_2_6_0, ruby_2_6_3, ruby_2_7_1, ruby_2_7_4, ruby_2_7_6, ruby_3_0_0, ruby_3_0_4,
-            ruby_3_1_2,
-        ];
         let mut ruby_versions: Vec<RubyVersion> = vec![];
-        for (i, ruby_version_config_raw) in ruby_version_configs_raw.iter().enumerate() {
+        for (i, ruby_version_config_raw) in ruby_version_configs.iter().enumerate() {
             let ruby_version_config: RubyVersionOffsets =
                 serde_yaml::from_str(ruby_version_config_raw)?;
             let key: u32 = i.try_into().unwrap();
@@ -156,6 +831,15 @@ impl<'a> Rbperf<'a> {
 
         debug!("use_ringbuf set to {}", options.use_ringbuf);
         open_skel.rodata().use_ringbuf = options.use_ringbuf;
+        if options.use_ringbuf {
+            debug!(
+                "ringbuf_wakeup_bytes set to {:?}",
+                options.ringbuf_wakeup_bytes
+            );
+            open_skel.rodata().ringbuf_wakeup_threshold = options.ringbuf_wakeup_bytes.unwrap_or(0);
+            debug!("ringbuf_shards set to {}", options.ringbuf_shards);
+            open_skel.rodata().ringbuf_shards = options.ringbuf_shards;
+        }
 
         open_skel.rodata().event_type = rbperf_event_type::from(options.event.clone());
 
@@ -165,26 +849,110 @@ impl<'a> Rbperf<'a> {
         }
 
         match options.event {
-            RbperfEvent::Cpu { sample_period: _ } => {
+            RbperfEvent::Cpu { .. } | RbperfEvent::Software { .. } => {
                 for prog in open_skel.obj.progs_iter_mut() {
                     prog.set_prog_type(ProgramType::PerfEvent);
                 }
             }
-            RbperfEvent::Syscall(_) => {
+            RbperfEvent::Syscall { weight, .. } => {
+                debug!("syscall_weight_field set to {}", weight.field());
+                open_skel.rodata().syscall_weight_field = weight.field();
+                for prog in open_skel.obj.progs_iter_mut() {
+                    prog.set_prog_type(ProgramType::Tracepoint);
+                }
+            }
+            RbperfEvent::Tracepoint { .. } => {
                 for prog in open_skel.obj.progs_iter_mut() {
                     prog.set_prog_type(ProgramType::Tracepoint);
                 }
             }
+            RbperfEvent::Kprobe(_) => {
+                for prog in open_skel.obj.progs_iter_mut() {
+                    prog.set_prog_type(ProgramType::Kprobe);
+                }
+            }
+            RbperfEvent::Gvl { min_wait_ns } => {
+                debug!("gvl_min_wait_ns set to {}", min_wait_ns);
+                open_skel.rodata().gvl_min_wait_ns = min_wait_ns;
+                for prog in open_skel.obj.progs_iter_mut() {
+                    prog.set_prog_type(ProgramType::Kprobe);
+                }
+            }
+            RbperfEvent::Runqueue { min_delay_ns } => {
+                debug!("runqueue_min_delay_ns set to {}", min_delay_ns);
+                open_skel.rodata().runqueue_min_delay_ns = min_delay_ns;
+                for prog in open_skel.obj.progs_iter_mut() {
+                    prog.set_prog_type(ProgramType::Kprobe);
+                }
+            }
+            RbperfEvent::Gc | RbperfEvent::Latency { .. } => {
+                for prog in open_skel.obj.progs_iter_mut() {
+                    prog.set_prog_type(ProgramType::Kprobe);
+                }
+            }
+            RbperfEvent::Allocation { sample_every } | RbperfEvent::Uprobe { sample_every, .. } => {
+                debug!("uprobe_sample_every set to {}", sample_every);
+                open_skel.rodata().uprobe_sample_every = sample_every;
+                for prog in open_skel.obj.progs_iter_mut() {
+                    prog.set_prog_type(ProgramType::Kprobe);
+                }
+            }
+        }
+        // Only attached with a uprobe, it doesn't tail call walk_ruby_stack
+        open_skel
+            .obj
+            .prog_mut("on_ruby_thread")
+            .unwrap()
+            .set_prog_type(ProgramType::Kprobe);
+        // Only load the entry programs of this event
+        let entry_programs = options.event.entry_programs();
+        for name in [
+            "on_event",
+            "on_gvl_wait",
+            "on_gvl_acquired",
+            "on_call_start",
+            "on_call_done",
+            "on_uprobe",
+            "on_task_wakeup",
+            "on_task_switch_in",
+        ] {
+            open_skel
+                .obj
+                .prog_mut(name)
+                .unwrap()
+                .set_autoload(entry_programs.contains(&name))
+                .unwrap();
         }
+        open_skel
+            .obj
+            .prog_mut("on_ruby_thread")
+            .unwrap()
+            .set_autoload(options.event.walks_current_thread())
+            .unwrap();
 
         let mut maps = open_skel.maps_mut();
+        debug!("frame_map_size set to {}", options.frame_map_size);
+        maps.id_to_stack()
+            .set_max_entries(options.frame_map_size)
+            .unwrap();
+        maps.stack_to_id()
+            .set_max_entries(options.frame_map_size)
+            .unwrap();
+        debug!("string_map_size set to {}", options.string_map_size);
+        maps.id_to_string()
+            .set_max_entries(options.string_map_size)
+            .unwrap();
+        maps.string_to_id()
+            .set_max_entries(options.string_map_size)
+            .unwrap();
+
         let events = maps.events();
 
         if options.use_ringbuf {
             events.set_type(MapType::RingBuf).unwrap();
             events.set_key_size(0).unwrap();
             events.set_value_size(0).unwrap();
-            events.set_max_entries(512 * 1024).unwrap(); // 512KB
+            events.set_max_entries(options.ringbuf_size).unwrap();
         } else {
             events.set_type(MapType::PerfEventArray).unwrap();
             events.set_key_size(4).unwrap();
@@ -192,6 +960,17 @@ impl<'a> Rbperf<'a> {
             events.set_max_entries(0).unwrap();
         }
 
+        // Unused shards are not created, as ring buffers can't be created
+        // before Linux 5.8, where the perf buffer is used instead
+        for shard in 1..MAX_RINGBUF_SHARDS {
+            let map = open_skel.obj.map_mut(shard_map_name(shard)).unwrap();
+            if options.use_ringbuf && shard < options.ringbuf_shards {
+                map.set_max_entries(options.ringbuf_size).unwrap();
+            } else {
+                map.set_autocreate(false).unwrap();
+            }
+        }
+
         let mut bpf = open_skel.load().unwrap();
         for prog in bpf.obj.progs_iter() {
             debug!(
@@ -215,6 +994,17 @@ impl<'a> Rbperf<'a> {
             ruby_versions,
             event: options.event,
             use_ringbuf: options.use_ringbuf,
+            ringbuf_shards: options.ringbuf_shards,
+            perf_buffer_pages: options.perf_buffer_pages,
+            overhead_report: options.overhead_report,
+            cpu_budget: options.cpu_budget,
+            max_loss_ratio: options.max_loss_ratio,
+            raw_out: options.raw_out,
+            pids: Vec::new(),
+            binaries: Vec::new(),
+            frames: IdCache::new(),
+            strings: IdCache::new(),
+            id_generation: 0,
             stats: Stats::default(),
         }
     }
@@ -271,6 +1061,8 @@ impl<'a> Rbperf<'a> {
         let process_info = ProcessInfo::new(pid)?;
         eprintln!("{}", process_info);
         self.add_process_info(&process_info)?;
+        self.pids.push(pid);
+        self.binaries.push((pid, process_info.binary_path.clone()));
 
         Ok(process_info)
     }
@@ -295,24 +1087,119 @@ impl<'a> Rbperf<'a> {
                     fds.push(perf_fd);
                 }
             }
-            RbperfEvent::Syscall(ref syscall_names) => {
-                for name in syscall_names {
+            RbperfEvent::Software {
+                event,
+                sample_period,
+            } => {
+                for i in 0..num_possible_cpus()? {
+                    let perf_fd = unsafe {
+                        setup_software_event(i.try_into().unwrap(), event, sample_period)
+                    }?;
+                    fds.push(perf_fd);
+                }
+            }
+            RbperfEvent::Syscall { ref names, .. } => {
+                for name in names {
                     let perf_fd = unsafe { setup_syscall_event(name) }?;
                     fds.push(perf_fd);
                 }
             }
+            RbperfEvent::Tracepoint {
+                ref category,
+                ref name,
+            } => {
+                let perf_fd = unsafe { setup_tracepoint_event(category, name) }?;
+                fds.push(perf_fd);
+            }
+            // Attached with a kprobe or uprobes below
+            RbperfEvent::Kprobe(_)
+            | RbperfEvent::Runqueue { .. }
+            | RbperfEvent::Gvl { .. }
+            | RbperfEvent::Gc
+            | RbperfEvent::Allocation { .. }
+            | RbperfEvent::Uprobe { .. }
+            | RbperfEvent::Latency { .. } => {}
         }
 
         let mut links = Vec::new();
         // prevent the links from being removed
         // https://github.com/libbpf/libbpf-rs/blob/5db2c5b37f7ce56c85c43df23e3114a3d87a786e/libbpf-rs/src/link.rs#L109
 
-        for fd in fds {
+        for &fd in &fds {
             let prog = self.bpf.obj.prog_mut("on_event").unwrap();
             let link = prog.attach_perf_event(fd);
             links.push(link);
         }
 
+        if let RbperfEvent::Kprobe(ref function) = self.event {
+            let prog = self.bpf.obj.prog_mut("on_event").unwrap();
+            links.push(Ok(prog.attach_kprobe(false, function)?));
+        }
+
+        if let RbperfEvent::Runqueue { .. } = self.event {
+            let prog = self.bpf.obj.prog_mut("on_task_wakeup").unwrap();
+            for function in TASK_WAKEUP_FUNCTIONS {
+                links.push(Ok(prog.attach_kprobe(false, function)?));
+            }
+            let prog = self.bpf.obj.prog_mut("on_task_switch_in").unwrap();
+            let link = TASK_SWITCH_IN_FUNCTIONS
+                .iter()
+                .find_map(|function| prog.attach_kprobe(false, function).ok())
+                .ok_or_else(|| anyhow!("couldn't find the kernel function threads switch in at"))?;
+            links.push(Ok(link));
+        }
+
+        let uprobes = self.event.uprobes();
+        for (pid, ruby_binary) in &self.binaries {
+            // Find all the functions first so that a pair isn't left with
+            // only one half attached
+            let mut found = Vec::new();
+            for uprobe in &uprobes {
+                let binary = match &uprobe.binary {
+                    Some(name) => find_mapped_file(*pid, name)?,
+                    None => ruby_binary.clone(),
+                };
+                match function_file_offset(&binary, &uprobe.function) {
+                    Ok(offset) => found.push((uprobe, binary, offset as usize)),
+                    Err(err) if self.event.needs_every_uprobe() => {
+                        return Err(anyhow!(
+                            "{} was not found for pid {}: {:?}",
+                            uprobe.function,
+                            pid,
+                            err
+                        ));
+                    }
+                    Err(err) => debug!("not attaching to {}: {:?}", uprobe.function, err),
+                }
+            }
+            if !uprobes.is_empty() && found.is_empty() {
+                return Err(anyhow!(
+                    "none of {:?} were found for pid {}",
+                    uprobes.iter().map(|u| &u.function).collect::<Vec<_>>(),
+                    pid
+                ));
+            }
+            for (uprobe, binary, offset) in found {
+                let prog = self.bpf.obj.prog_mut(uprobe.program).unwrap();
+                links.push(Ok(prog.attach_uprobe(
+                    uprobe.retprobe,
+                    *pid,
+                    &binary,
+                    offset,
+                )?));
+            }
+            if self.event.walks_current_thread() {
+                let offset = function_file_offset(ruby_binary, GVL_ACQUIRE_FUNCTION)?;
+                let prog = self.bpf.obj.prog_mut("on_ruby_thread").unwrap();
+                links.push(Ok(prog.attach_uprobe(
+                    false,
+                    *pid,
+                    ruby_binary,
+                    offset as usize,
+                )?));
+            }
+        }
+
         for prog in self.bpf.obj.progs_iter_mut() {
             debug!("program type {}", prog.prog_type());
         }
@@ -329,11 +1216,37 @@ impl<'a> Rbperf<'a> {
 
         let maps = self.bpf.maps();
         let events = maps.events();
+        let mut id_maps = IdMaps::new(
+            maps.id_generation().fd(),
+            maps.id_counters().fd(),
+            [
+                maps.id_to_stack(),
+                maps.stack_to_id(),
+                maps.id_to_string(),
+                maps.string_to_id(),
+            ]
+            .iter()
+            .map(|map| (map.fd(), map.key_size() as usize))
+            .collect(),
+            num_possible_cpus()?,
+        );
 
+        let timeout = Duration::from_millis(100);
+        // Written by the perf buffer's lost callback
+        let lost_events: Vec<AtomicU64> = (0..num_possible_cpus()?)
+            .map(|_| AtomicU64::new(0))
+            .collect();
         let mut perfbuf = None;
         let mut ringbuf = None;
+        let mut shard_consumers = None;
 
-        if self.use_ringbuf {
+        if self.use_ringbuf && self.ringbuf_shards > 1 {
+            let map_fds: Vec<i32> = (0..self.ringbuf_shards)
+                .map(|shard| self.bpf.obj.map(shard_map_name(shard)).unwrap().fd())
+                .collect();
+            let sender = self.sender.lock().unwrap().clone();
+            shard_consumers = Some(ShardConsumers::start(&map_fds, &sender, timeout)?);
+        } else if self.use_ringbuf {
             let mut builder = libbpf_rs::RingBufferBuilder::new();
             builder.add(events, |data: &[u8]| -> i32 {
                 handle_event(&mut sender, 0, data);
@@ -342,143 +1255,271 @@ impl<'a> Rbperf<'a> {
             ringbuf = Some(builder.build()?);
         } else {
             let perf_buffer = PerfBufferBuilder::new(self.bpf.maps().events())
+                .pages(self.perf_buffer_pages)
                 .sample_cb(|cpu: i32, data: &[u8]| {
                     handle_event(&mut sender, cpu, data);
                 })
                 .lost_cb(|cpu, count| {
-                    // TODO: self.stats.incomplete_stack_errors += 1;
+                    if let Some(lost) = lost_events.get(cpu as usize) {
+                        lost.fetch_add(count, Ordering::Relaxed);
+                    }
                     handle_lost_events(cpu, count)
                 })
                 .build()?;
             perfbuf = Some(perf_buffer);
         }
 
+        // The kernel only tracks the runtime of BPF programs while
+        // stats are enabled
+        let bpf_stats = if self.overhead_report || self.cpu_budget.is_some() {
+            Some(BpfStatsGuard::new()?)
+        } else {
+            None
+        };
+        let on_event_fd = self.bpf.obj.prog("on_event").unwrap().fd();
+
+        let mut overhead = None;
+        if self.overhead_report {
+            // The tracker takes the walking program as the entry program
+            let walking_program = self.event.walking_program();
+            let programs = std::iter::once(&walking_program)
+                .chain(
+                    self.event
+                        .entry_programs()
+                        .iter()
+                        .filter(|name| **name != walking_program),
+                )
+                .chain(["walk_ruby_stack"].iter())
+                .map(|name| (name.to_string(), self.bpf.obj.prog(name).unwrap().fd()))
+                .collect();
+            overhead = Some(OverheadTracker::new(programs, self.pids.clone())?);
+        }
+
+        let mut watchdog = None;
+        if self.cpu_budget.is_some() || self.max_loss_ratio.is_some() {
+            watchdog = Some(Watchdog::new(
+                self.cpu_budget,
+                self.max_loss_ratio,
+                self.event.sample_period(),
+            ));
+        }
+        let mut watchdog_last_run = ProgramRunStats::read(on_event_fd).unwrap_or_default();
+        let mut watchdog_last_self_cpu = self_cpu_time_ns();
+
+        // Consumes the stacks pending in the buffers, the shards are drained
+        // on their own threads
+        let drain_buffers = || {
+            if let Some(ringbuf) = ringbuf.as_ref() {
+                if let Err(err) = ringbuf.consume() {
+                    debug!("Consuming ringbuf failed with {:?}", err);
+                }
+            }
+            if let Some(perfbuf) = perfbuf.as_ref() {
+                if let Err(err) = perfbuf.poll(Duration::ZERO) {
+                    debug!("Polling perfbuf failed with {:?}", err);
+                }
+            }
+        };
+
         // Start polling
         self.started_at = Some(Instant::now());
-        let timeout = Duration::from_millis(100);
+        let stats_interval = Duration::from_secs(1);
+        let mut stats_read_at = Instant::now();
 
         while self.should_run() && runnable.load(Ordering::SeqCst) {
-            if self.use_ringbuf {
-                if let Err(err) = ringbuf.as_ref().unwrap().poll(timeout) {
+            if shard_consumers.is_some() {
+                // The shards are drained on their own threads
+                thread::sleep(timeout);
+            } else if self.use_ringbuf {
+                let ringbuf = ringbuf.as_ref().unwrap();
+                if let Err(err) = ringbuf.poll(timeout) {
                     debug!("Polling ringbuf failed with {:?}", err);
                 }
+                // With batched wakeups, poll can time out with samples
+                // pending below the threshold
+                if let Err(err) = ringbuf.consume() {
+                    debug!("Consuming ringbuf failed with {:?}", err);
+                }
             } else if let Err(err) = perfbuf.as_ref().unwrap().poll(timeout) {
                 debug!("Polling perfbuf failed with {:?}", err);
             }
-        }
-
-        // Read all the data and finish
-        let stats = self.process(profile);
-        Ok(stats)
-    }
-
-    fn process(mut self, profile: &mut Profile) -> Stats {
-        let recv = self.receiver.clone();
-        let maps = self.bpf.maps();
-        let id_to_stack = maps.id_to_stack();
-
-        loop {
-            let read = recv.lock().unwrap().try_recv();
-            match read {
-                Ok(data) => {
-                    let mut read_frame_count = 0;
-                    self.stats.total_events += 1;
-
-                    if data.stack_status == ruby_stack_status_STACK_INCOMPLETE {
-                        // TODO: allow users to decide wether to discard incomplete stacks
-                        debug!("incomplete stack");
-                        self.stats.incomplete_stack_errors += 1;
-                        continue;
+            let handed_out_ids = sync_frames(&maps, &mut self.frames, &mut self.strings);
+            if handed_out_ids > ID_RECYCLING_THRESHOLD && self.raw_out.is_some() {
+                // The raw capture needs every id, so they can't be recycled.
+                // Stop rather than let the caches grow until BPF runs out
+                error!(
+                    "Stopping early, the raw capture can't hold more than {} frames or strings per CPU",
+                    ID_RECYCLING_THRESHOLD
+                );
+                break;
+            }
+            if handed_out_ids > ID_RECYCLING_THRESHOLD {
+                // BPF drops the stacks being walked, and the ones it sent
+                // are decoded before their ids can refer to other frames and
+                // strings
+                match id_maps.pause() {
+                    Ok(()) => {
+                        thread::sleep(ID_RECYCLING_GRACE_PERIOD);
+                        drain_buffers();
+                        sync_frames(&maps, &mut self.frames, &mut self.strings);
+                        decode_received(
+                            &self.receiver,
+                            &self.frames,
+                            &self.strings,
+                            self.id_generation,
+                            matches!(self.event, RbperfEvent::Syscall { .. }),
+                            profile,
+                            &mut self.stats,
+                        );
+                        if let Err(err) = id_maps.clear() {
+                            error!("Recycling the ids failed with {:?}", err);
+                        }
+                        self.frames.clear();
+                        self.strings.clear();
+                        if let Err(err) = id_maps.resume() {
+                            error!("Resuming after recycling the ids failed with {:?}", err);
+                        }
+                        self.id_generation = id_maps.generation();
+                        self.stats.id_recycles += 1;
                     }
+                    Err(err) => error!("Recycling the ids failed with {:?}", err),
+                }
+            }
 
-                    if data.pid == 0 {
-                        panic!("pid is zero, this should never happen");
-                    }
+            if let Some(tracker) = overhead.as_mut() {
+                tracker.sample();
+            }
 
-                    let comm_bytes: Vec<u8> = data.comm.iter().map(|&c| c as u8).collect();
-                    let comm = unsafe { str_from_u8_nul(&comm_bytes) };
-                    if comm.is_err() {
-                        self.stats.garbled_data_errors += 1;
-                        continue;
+            if stats_read_at.elapsed() >= stats_interval {
+                let interval = stats_read_at.elapsed();
+                let last_emitted = self.stats.bpf_samples_emitted;
+                let last_output_errors = self.stats.bpf_output_errors;
+                self.stats.read_bpf_stats(maps.bpf_stats());
+                debug!("stats: {:?}", self.stats);
+                stats_read_at = Instant::now();
+
+                if let Some(watchdog) = watchdog.as_mut() {
+                    // BPF runtime plus our own, over all the host's CPUs
+                    let run = ProgramRunStats::read(on_event_fd).unwrap_or(watchdog_last_run);
+                    let self_cpu = self_cpu_time_ns();
+                    let used_ns = run
+                        .run_time_ns
+                        .saturating_sub(watchdog_last_run.run_time_ns)
+                        + self_cpu.saturating_sub(watchdog_last_self_cpu);
+                    let usage =
+                        used_ns as f64 / (interval.as_nanos() as f64 * num_online_cpus() as f64);
+                    // BPF counts the stacks it couldn't write for both the
+                    // ring and perf buffers
+                    let loss_ratio = loss_ratio(
+                        self.stats.bpf_samples_emitted.saturating_sub(last_emitted),
+                        self.stats
+                            .bpf_output_errors
+                            .saturating_sub(last_output_errors),
+                    );
+                    debug!(
+                        "watchdog: {} events in the last interval, {:.4}% CPU, {:.2}% lost",
+                        run.run_count.saturating_sub(watchdog_last_run.run_count),
+                        usage * 100.0,
+                        loss_ratio * 100.0
+                    );
+                    watchdog_last_run = run;
+                    watchdog_last_self_cpu = self_cpu;
+
+                    if let Some(action) = watchdog.observe(usage, loss_ratio) {
+                        apply_watchdog_action(&fds, &action, &mut self.event, &mut self.stats);
                     }
-                    let comm = comm.expect("comm should be valid unicode").to_string();
-                    let mut frames: Vec<(String, String)> = Vec::new();
+                }
+            }
+        }
 
-                    for frame_idx in &data.frames {
-                        // Don't read past the last frame
-                        if read_frame_count >= data.size {
-                            continue;
-                        }
-                        if *frame_idx == 0 {
-                            panic!("Frame id is zero, this should never happen");
-                        }
+        // Drain whatever is left in the buffers
+        if let Some(consumers) = shard_consumers {
+            consumers.stop();
+        }
+        drain_buffers();
 
-                        let frame_bytes =
-                            id_to_stack.lookup(&frame_idx.to_le_bytes(), MapFlags::ANY);
-                        if let Err(err) = frame_bytes {
-                            debug!("Reading from id_to_stack failed with {:?}", err);
-                            self.stats.map_reading_errors += 1;
-                            continue;
-                        };
-                        let frame = unsafe {
-                            parse_frame(
-                                &frame_bytes
-                                    .expect("frame_idx should not fail")
-                                    .expect("frame_idx should exist"),
-                            )
-                        };
-                        let method_name_bytes: Vec<u8> =
-                            frame.method_name.iter().map(|&c| c as u8).collect();
-                        let path_name_bytes: Vec<u8> =
-                            frame.path.iter().map(|&c| c as u8).collect();
-
-                        let method_name = unsafe { str_from_u8_nul(&method_name_bytes) };
-                        if method_name.is_err() {
-                            self.stats.incomplete_stack_errors += 1;
-                            continue;
-                        }
-                        let method_name = method_name
-                            .expect("method name should be valid unicode")
-                            .to_string();
-
-                        let path_name = unsafe { str_from_u8_nul(&path_name_bytes) };
-                        if path_name.is_err() {
-                            self.stats.incomplete_stack_errors += 1;
-                            continue;
-                        }
-                        let path_name = path_name
-                            .expect("path name should be valid unicode")
-                            .to_string();
+        self.stats.lost_events_per_cpu = lost_events
+            .iter()
+            .map(|lost| lost.load(Ordering::Relaxed))
+            .collect();
+        self.stats.lost_event_errors = self.stats.lost_events_per_cpu.iter().sum();
 
-                        frames.push((method_name, path_name));
-                        read_frame_count += 1;
-                    }
+        // Report the overhead of profiling before decoding, which only
+        // happens once
+        self.stats.read_bpf_stats(maps.bpf_stats());
+        let overhead_report = overhead
+            .as_mut()
+            .map(|tracker| tracker.report(self.stats.bpf_samples_emitted));
 
-                    // Add generated frames
-                    if let RbperfEvent::Syscall(_) = self.event {
-                        let syscall_number = syscalls::Sysno::from(data.syscall_id);
-                        frames.push((
-                            format!("{}", syscall_number).to_string(),
-                            "<syscall>".to_string(),
-                        ));
-                    }
+        // Read all the data and finish
+        let mut stats = self.process(profile)?;
+        stats.overhead = overhead_report;
+        stats.final_sample_period = watchdog.as_ref().and_then(|w| w.sample_period());
+        drop(bpf_stats);
+        Ok(stats)
+    }
 
-                    if data.size == read_frame_count {
-                        profile.add_sample(data.pid as Pid, comm, frames);
-                    } else {
-                        error!(
-                            "mismatched expected={} and received={} frame count",
-                            data.size, read_frame_count
-                        );
-                    }
-                }
+    fn process(&mut self, profile: &mut Profile) -> Result<Stats> {
+        sync_frames(&self.bpf.maps(), &mut self.frames, &mut self.strings);
+        self.stats.read_bpf_stats(self.bpf.maps().bpf_stats());
+
+        let syscall_frames = matches!(self.event, RbperfEvent::Syscall { .. });
+        let stacks = decode_received(
+            &self.receiver,
+            &self.frames,
+            &self.strings,
+            self.id_generation,
+            syscall_frames,
+            profile,
+            &mut self.stats,
+        );
+        if let Some(raw_out) = &self.raw_out {
+            let mut writer = BufWriter::new(File::create(raw_out)?);
+            write_capture(
+                &mut writer,
+                syscall_frames,
+                self.event.weight_unit(),
+                &self.frames,
+                &self.strings,
+                &stacks,
+            )?;
+            writer.flush()?;
+        }
+        Ok(self.stats.clone())
+    }
+}
 
-                // We have read all the elements in the channel
-                Err(_) => {
-                    return self.stats;
-                }
-            }
+// Applies the watchdog's decision to every perf event and records it.
+// Takes the fields it needs rather than `self`, as it's called while the
+// maps are borrowed.
+fn apply_watchdog_action(
+    fds: &[i32],
+    action: &WatchdogAction,
+    event: &mut RbperfEvent,
+    stats: &mut Stats,
+) {
+    for &fd in fds {
+        let result = match action {
+            WatchdogAction::SetSamplePeriod(period) => unsafe { set_sample_period(fd, *period) },
+            WatchdogAction::Disable => unsafe { enable_event(fd, false) },
+            WatchdogAction::Enable => unsafe { enable_event(fd, true) },
+        };
+        if let Err(err) = result {
+            error!("watchdog: {:?} failed with {:?}", action, err);
+        }
+    }
+
+    let current_period = event.sample_period().unwrap_or(0);
+    match action {
+        WatchdogAction::SetSamplePeriod(period) if *period > current_period => {
+            stats.watchdog_throttles += 1
         }
+        WatchdogAction::SetSamplePeriod(_) => stats.watchdog_restores += 1,
+        WatchdogAction::Disable => stats.watchdog_disables += 1,
+        WatchdogAction::Enable => stats.watchdog_restores += 1,
+    }
+    if let WatchdogAction::SetSamplePeriod(period) = action {
+        event.set_sample_period(*period);
     }
 }
 
@@ -493,33 +1534,217 @@ mod tests {
     use std::process::{Command, Stdio};
     use std::{thread, time::Duration};
 
-    const DEFAULT_RUBY_VERSION: &str = "3.0.0";
-
-    struct TestProcess {
-        container_name: String,
-        pid: Option<i32>,
+    #[test]
+    fn test_syscall_weight() {
+        let names =
+            |names: &[&str]| -> Vec<String> { names.iter().map(|n| n.to_string()).collect() };
+        assert_eq!(
+            SyscallWeight::parse("bytes", &names(&["exit_read", "exit_writev"])).unwrap(),
+            SyscallWeight::Ret(WeightUnit::Bytes)
+        );
+        assert_eq!(
+            SyscallWeight::parse("bytes", &names(&["enter_write", "enter_sendto"])).unwrap(),
+            SyscallWeight::Arg(2, WeightUnit::Bytes)
+        );
+        assert!(SyscallWeight::parse("bytes", &names(&["enter_writev"])).is_err());
+        assert_eq!(
+            SyscallWeight::parse("arg0", &names(&["enter_close"])).unwrap(),
+            SyscallWeight::Arg(0, WeightUnit::Count)
+        );
+        assert!(SyscallWeight::parse("fd", &names(&["enter_close"])).is_err());
     }
-    impl TestProcess {
-        fn new(program: &str, ruby_version: &str) -> Self {
-            let test_random_id: u64 = rand::random();
-            let container_name = format!("rbperf-test-container-{}", test_random_id);
 
-            let _ = Command::new("podman")
-                .args([
-                    "run",
-                    "--rm",
-                    "--name",
-                    &container_name,
-                    "-v",
-                    // https://stackoverflow.com/questions/24288616/permission-denied-on-accessing-host-directory-in-docker
-                    &format!(
-                        "{}:/usr/src/myapp:z",
-                        project_root::get_project_root()
-                            .expect("Retrieve project root")
-                            .display()
-                    )
-                    .as_str(),
-                    "-w",
+    #[test]
+    fn test_validate_events() {
+        let options = RbperfOptions {
+            event: RbperfEvent::Allocation { sample_every: 0 },
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+        let options = RbperfOptions {
+            event: RbperfEvent::Uprobe {
+                binary: "libpq".to_string(),
+                symbol: "PQexec".to_string(),
+                sample_every: 1,
+            },
+            ..Default::default()
+        };
+        assert!(options.validate().is_ok());
+        let options = RbperfOptions {
+            event: RbperfEvent::Gc,
+            cpu_budget: Some(0.1),
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+        let options = RbperfOptions {
+            event: RbperfEvent::Software {
+                event: SoftwareEvent::PageFaults,
+                sample_period: 100,
+            },
+            cpu_budget: Some(0.1),
+            ..Default::default()
+        };
+        assert!(options.validate().is_ok());
+        let options = RbperfOptions {
+            event: RbperfEvent::Syscall {
+                names: vec!["enter_writev".to_string()],
+                weight: SyscallWeight::Calls,
+            },
+            cpu_budget: Some(0.1),
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+        let options = RbperfOptions {
+            event: RbperfEvent::Tracepoint {
+                category: "syscalls".to_string(),
+                name: "sys_enter_write".to_string(),
+            },
+            cpu_budget: Some(0.1),
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+        let options = RbperfOptions {
+            event: RbperfEvent::Syscall {
+                names: vec!["exit_read".to_string()],
+                weight: SyscallWeight::Arg(2, WeightUnit::Bytes),
+            },
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+    }
+
+    #[test]
+    fn test_validate_buffer_sizes() {
+        assert!(RbperfOptions::default().validate().is_ok());
+        let options = RbperfOptions {
+            ringbuf_size: 3 * 4096,
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+        let options = RbperfOptions {
+            ringbuf_wakeup_bytes: Some(1024 * 1024),
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+        let options = RbperfOptions {
+            perf_buffer_pages: 3,
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+        let options = RbperfOptions {
+            ringbuf_shards: MAX_RINGBUF_SHARDS + 1,
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+        let options = RbperfOptions {
+            ringbuf_shards: 2,
+            use_ringbuf: false,
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+        let options = RbperfOptions {
+            ringbuf_shards: 2,
+            use_ringbuf: true,
+            ..Default::default()
+        };
+        assert!(options.validate().is_ok());
+    }
+
+    #[test]
+    fn test_loss_ratio() {
+        assert_eq!(loss_ratio(0, 0), 0.0);
+        assert_eq!(loss_ratio(3, 1), 0.25);
+        let stats = Stats {
+            bpf_samples_emitted: 9,
+            bpf_output_errors: 1,
+            ..Default::default()
+        };
+        assert_eq!(stats.loss_ratio(), 0.1);
+
+        let options = RbperfOptions {
+            event: RbperfEvent::Syscall {
+                names: vec!["enter_writev".to_string()],
+                weight: SyscallWeight::Calls,
+            },
+            max_loss_ratio: Some(0.1),
+            ..Default::default()
+        };
+        assert!(options.validate().is_err());
+    }
+
+    #[test]
+    fn test_needs_every_uprobe() {
+        assert!(RbperfEvent::Gvl { min_wait_ns: 0 }.needs_every_uprobe());
+        assert!(RbperfEvent::Gc.needs_every_uprobe());
+        assert!(RbperfEvent::Latency {
+            binary: "libpq".to_string(),
+            symbol: "PQexec".to_string(),
+        }
+        .needs_every_uprobe());
+        assert!(!RbperfEvent::Allocation { sample_every: 1 }.needs_every_uprobe());
+    }
+
+    #[test]
+    fn test_retain_generation() {
+        let stack = |id_generation| RubyStack {
+            id_generation,
+            ..unsafe { std::mem::zeroed() }
+        };
+        let mut stacks = vec![stack(0), stack(2), stack(2), stack(4)];
+        assert_eq!(retain_generation(&mut stacks, 2), 2);
+        assert_eq!(stacks, vec![stack(2), stack(2)]);
+    }
+
+    #[test]
+    fn test_walking_program() {
+        let events = [
+            RbperfEvent::Cpu { sample_period: 1 },
+            RbperfEvent::Gvl { min_wait_ns: 0 },
+            RbperfEvent::Runqueue { min_delay_ns: 0 },
+            RbperfEvent::Gc,
+            RbperfEvent::Allocation { sample_every: 1 },
+        ];
+        for event in &events {
+            assert!(event.entry_programs().contains(&event.walking_program()));
+        }
+        assert_eq!(
+            RbperfEvent::Gvl { min_wait_ns: 0 }.walking_program(),
+            "on_gvl_acquired"
+        );
+        assert_eq!(
+            RbperfEvent::Runqueue { min_delay_ns: 0 }.walking_program(),
+            "on_task_switch_in"
+        );
+        assert_eq!(RbperfEvent::Gc.walking_program(), "on_call_done");
+    }
+
+    const DEFAULT_RUBY_VERSION: &str = "3.0.0";
+
+    struct TestProcess {
+        container_name: String,
+        pid: Option<i32>,
+    }
+    impl TestProcess {
+        fn new(program: &str, ruby_version: &str) -> Self {
+            let test_random_id: u64 = rand::random();
+            let container_name = format!("rbperf-test-container-{}", test_random_id);
+
+            let _ = Command::new("podman")
+                .args([
+                    "run",
+                    "--rm",
+                    "--name",
+                    &container_name,
+                    "-v",
+                    // https://stackoverflow.com/questions/24288616/permission-denied-on-accessing-host-directory-in-docker
+                    &format!(
+                        "{}:/usr/src/myapp:z",
+                        project_root::get_project_root()
+                            .expect("Retrieve project root")
+                            .display()
+                    )
+                    .as_str(),
+                    "-w",
                     "/usr/src/myapp",
                     &format!("ruby:{}", ruby_version).as_str(),
                     "ruby",
@@ -587,26 +1812,34 @@ mod tests {
         // TODO: Improve process ready detection
         thread::sleep(Duration::from_millis(250));
 
+        let event = RbperfEvent::Cpu {
+            sample_period: 99999,
+        };
+        assert_eq!(event.weight_unit(), WeightUnit::Cycles);
         let options = RbperfOptions {
-            event: RbperfEvent::Cpu {
-                sample_period: 99999,
-            },
+            event,
             verbose_bpf_logging: true,
             use_ringbuf: false,
             verbose_libbpf_logging: false,
             disable_pid_race_detector: false,
+            ..Default::default()
         };
         let mut r = Rbperf::new(options);
         r.add_pid(pid).unwrap();
 
         let duration = std::time::Duration::from_millis(1500);
-        let mut profile = Profile::new();
+        let mut profile = Profile::with_unit(WeightUnit::Cycles);
         r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
             .unwrap();
         let folded = profile.folded();
         println!("folded: {}", folded);
 
         assert!(folded.contains("<main> - tests/programs/cpu_hog.rb;a1 - tests/programs/cpu_hog.rb;b1 - tests/programs/cpu_hog.rb;c1 - tests/programs/cpu_hog.rb;cpu - tests/programs/cpu_hog.rb;<native code>"));
+        // Every sample stands for a period's worth of cycles
+        for line in folded.lines() {
+            let weight: u64 = line.rsplit(' ').next().unwrap().parse().unwrap();
+            assert_eq!(weight % 99999, 0);
+        }
     }
 
     #[test]
@@ -616,11 +1849,15 @@ mod tests {
         thread::sleep(Duration::from_millis(250));
 
         let options = RbperfOptions {
-            event: RbperfEvent::Syscall(vec!["enter_writev".to_string()]),
+            event: RbperfEvent::Syscall {
+                names: vec!["enter_writev".to_string()],
+                weight: SyscallWeight::Calls,
+            },
             verbose_bpf_logging: true,
             use_ringbuf: true,
             verbose_libbpf_logging: false,
             disable_pid_race_detector: false,
+            ..Default::default()
         };
         let mut r = Rbperf::new(options);
         r.add_pid(pid).unwrap();
@@ -643,11 +1880,15 @@ mod tests {
         thread::sleep(Duration::from_millis(250));
 
         let options = RbperfOptions {
-            event: RbperfEvent::Syscall(vec!["enter_writev".to_string()]),
+            event: RbperfEvent::Syscall {
+                names: vec!["enter_writev".to_string()],
+                weight: SyscallWeight::Calls,
+            },
             verbose_bpf_logging: false,
             use_ringbuf: false,
             verbose_libbpf_logging: false,
             disable_pid_race_detector: false,
+            ..Default::default()
         };
         let mut r = Rbperf::new(options);
         r.add_pid(pid).unwrap();
@@ -670,11 +1911,15 @@ mod tests {
         thread::sleep(Duration::from_millis(250));
 
         let options = RbperfOptions {
-            event: RbperfEvent::Syscall(vec!["enter_writev".to_string()]),
+            event: RbperfEvent::Syscall {
+                names: vec!["enter_writev".to_string()],
+                weight: SyscallWeight::Calls,
+            },
             verbose_bpf_logging: false,
             use_ringbuf: false,
             verbose_libbpf_logging: false,
             disable_pid_race_detector: false,
+            ..Default::default()
         };
         let mut r = Rbperf::new(options);
         r.add_pid(pid).unwrap();
@@ -694,6 +1939,352 @@ mod tests {
         assert!(folded.contains(&expected));
     }
 
+    #[test]
+    fn test_gvl_profiling() {
+        let mut tp = TestProcess::new("tests/programs/gvl_contention.rb", DEFAULT_RUBY_VERSION);
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let options = RbperfOptions {
+            event: RbperfEvent::Gvl {
+                min_wait_ns: 10_000,
+            },
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::with_unit(WeightUnit::Nanoseconds);
+        let stats = r
+            .start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        assert!(folded.contains(
+            "contend - tests/programs/gvl_contention.rb;spin - tests/programs/gvl_contention.rb"
+        ));
+        // Every wait is weighted by its duration, at least the minimum
+        assert!(profile.latencies().iter().all(|l| l.p50 >= 10_000));
+        assert!(stats.total_events > 0);
+    }
+
+    #[test]
+    fn test_runqueue_profiling() {
+        let mut tp = TestProcess::new("tests/programs/gvl_contention.rb", DEFAULT_RUBY_VERSION);
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let options = RbperfOptions {
+            // Every wakeup waits a little before running
+            event: RbperfEvent::Runqueue { min_delay_ns: 0 },
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::with_unit(WeightUnit::Nanoseconds);
+        r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        // The threads woken up to take the GVL get their own stacks
+        assert!(folded.contains(
+            "contend - tests/programs/gvl_contention.rb;spin - tests/programs/gvl_contention.rb"
+        ));
+    }
+
+    #[test]
+    fn test_gc_profiling() {
+        // On 2.x, where the main thread's execution context is the one
+        // the VM points to
+        let mut tp = TestProcess::new("tests/programs/allocating_thread.rb", "2.7.6");
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let options = RbperfOptions {
+            event: RbperfEvent::Gc,
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::with_unit(WeightUnit::Nanoseconds);
+        r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        // The worker's stack, rather than the main thread's
+        assert!(folded.contains("work - tests/programs/allocating_thread.rb;allocate - tests/programs/allocating_thread.rb"));
+        assert!(folded.contains("<garbage collection> - <gc>"));
+    }
+
+    #[test]
+    fn test_allocation_profiling() {
+        let mut tp = TestProcess::new("tests/programs/allocating_thread.rb", DEFAULT_RUBY_VERSION);
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let options = RbperfOptions {
+            event: RbperfEvent::Allocation { sample_every: 100 },
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::new();
+        r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        assert!(folded.contains("work - tests/programs/allocating_thread.rb;allocate - tests/programs/allocating_thread.rb"));
+    }
+
+    #[test]
+    fn test_uprobe_profiling() {
+        let mut tp = TestProcess::new("tests/programs/native_calls.rb", DEFAULT_RUBY_VERSION);
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let options = RbperfOptions {
+            // libc.so rather than libc, which libcrypt also contains
+            event: RbperfEvent::Uprobe {
+                binary: "libc.so".to_string(),
+                symbol: "write".to_string(),
+                sample_every: 1,
+            },
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::new();
+        r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        assert!(folded.contains(
+            "work - tests/programs/native_calls.rb;write_null - tests/programs/native_calls.rb"
+        ));
+    }
+
+    #[test]
+    fn test_latency_profiling() {
+        let mut tp = TestProcess::new("tests/programs/native_calls.rb", DEFAULT_RUBY_VERSION);
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let options = RbperfOptions {
+            event: RbperfEvent::Latency {
+                binary: "libc.so".to_string(),
+                symbol: "write".to_string(),
+            },
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::with_unit(WeightUnit::Nanoseconds);
+        r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        // The calls are made by the worker, while the main thread waits
+        assert!(folded.contains(
+            "work - tests/programs/native_calls.rb;write_null - tests/programs/native_calls.rb"
+        ));
+        let latencies = profile.latencies();
+        assert!(!latencies.is_empty());
+        assert!(latencies.iter().all(|l| l.max > 0));
+    }
+
+    #[test]
+    fn test_tracepoint_profiling() {
+        let mut tp = TestProcess::new("tests/programs/native_calls.rb", DEFAULT_RUBY_VERSION);
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let options = RbperfOptions {
+            event: RbperfEvent::Tracepoint {
+                category: "syscalls".to_string(),
+                name: "sys_enter_write".to_string(),
+            },
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::new();
+        r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        // The worker writes, while the main thread waits in join
+        assert!(folded.contains(
+            "work - tests/programs/native_calls.rb;write_null - tests/programs/native_calls.rb"
+        ));
+        assert!(!folded.contains("join"));
+    }
+
+    #[test]
+    fn test_kprobe_profiling() {
+        let mut tp = TestProcess::new("tests/programs/native_calls.rb", DEFAULT_RUBY_VERSION);
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let options = RbperfOptions {
+            // Called by every write(2), and not inlined
+            event: RbperfEvent::Kprobe("vfs_write".to_string()),
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::new();
+        r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        assert!(folded.contains(
+            "work - tests/programs/native_calls.rb;write_null - tests/programs/native_calls.rb"
+        ));
+        assert!(!folded.contains("join"));
+    }
+
+    #[test]
+    fn test_software_event_profiling() {
+        let mut tp = TestProcess::new("tests/programs/gvl_contention.rb", DEFAULT_RUBY_VERSION);
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let event = RbperfEvent::Software {
+            event: SoftwareEvent::CpuClock,
+            sample_period: 1_000_000,
+        };
+        assert_eq!(event.weight_unit(), WeightUnit::Nanoseconds);
+        let options = RbperfOptions {
+            event,
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::with_unit(WeightUnit::Nanoseconds);
+        r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        // The worker threads use the CPU, while the main thread waits
+        assert!(folded.contains(
+            "contend - tests/programs/gvl_contention.rb;spin - tests/programs/gvl_contention.rb"
+        ));
+        assert!(!folded.contains("join"));
+        // Every sample weighs the period
+        for line in folded.lines() {
+            let weight: u64 = line.rsplit(' ').next().unwrap().parse().unwrap();
+            assert_eq!(weight % 1_000_000, 0);
+        }
+    }
+
+    #[test]
+    fn test_syscall_bytes_profiling() {
+        let mut tp = TestProcess::new("tests/programs/simple_two_stacks.rb", DEFAULT_RUBY_VERSION);
+        let pid = tp.wait_for_container();
+        thread::sleep(Duration::from_millis(250));
+
+        let names = vec!["exit_writev".to_string()];
+        let options = RbperfOptions {
+            event: RbperfEvent::Syscall {
+                weight: SyscallWeight::parse("bytes", &names).unwrap(),
+                names,
+            },
+            verbose_bpf_logging: false,
+            use_ringbuf: false,
+            verbose_libbpf_logging: false,
+            disable_pid_race_detector: false,
+            ..Default::default()
+        };
+        let mut r = Rbperf::new(options);
+        r.add_pid(pid).unwrap();
+
+        let duration = std::time::Duration::from_millis(1500);
+        let mut profile = Profile::with_unit(WeightUnit::Bytes);
+        r.start(duration, &mut profile, Arc::new(AtomicBool::new(true)))
+            .unwrap();
+        let folded = profile.folded();
+        println!("folded: {}", folded);
+
+        // puts writes "hi\n" and "hi2\n"
+        let weight = |leaf: &str| -> u64 {
+            let line = folded
+                .lines()
+                .find(|line| line.contains(leaf))
+                .expect("stack not found");
+            line.rsplit(' ').next().unwrap().parse().unwrap()
+        };
+        assert_eq!(
+            weight("say_hi1 - tests/programs/simple_two_stacks.rb") % 3,
+            0
+        );
+        assert_eq!(
+            weight("say_hi2 - tests/programs/simple_two_stacks.rb") % 4,
+            0
+        );
+    }
+
     macro_rules! rbperf_tests {
         ($($name:ident: $value:expr,)*) => {
         $(
@@ -706,11 +2297,15 @@ mod tests {
             thread::sleep(Duration::from_millis(250));
 
             let options = RbperfOptions {
-                event: RbperfEvent::Syscall(vec!["enter_writev".to_string()]),
+                event: RbperfEvent::Syscall {
+                names: vec!["enter_writev".to_string()],
+                weight: SyscallWeight::Calls,
+            },
                 verbose_bpf_logging: true,
                 use_ringbuf: false,
                 verbose_libbpf_logging: false,
                 disable_pid_race_detector: false,
+                ..Default::default()
             };
             let mut r = Rbperf::new(options);
             r.add_pid(pid).unwrap();
@@ -0,0 +1,153 @@
+use std::os::raw::{c_int, c_void};
+use std::slice;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::Sender;
+use std::sync::Arc;
+use std::thread::{self, JoinHandle};
+use std::time::Duration;
+
+use anyhow::{anyhow, Result};
+use errno::errno;
+use log::{debug, error};
+
+use crate::ruby_readers::parse_stack;
+use crate::RubyStack;
+
+/// Name of the BPF map backing a ring buffer shard.
+pub fn shard_map_name(shard: u32) -> String {
+    if shard == 0 {
+        "events".to_string()
+    } else {
+        format!("events_{}", shard)
+    }
+}
+
+unsafe extern "C" fn handle_sample(
+    ctx: *mut c_void,
+    data: *mut c_void,
+    size: libbpf_sys::size_t,
+) -> c_int {
+    let sender = &*(ctx as *const Sender<RubyStack>);
+    let data = slice::from_raw_parts(data as *const u8, size as usize);
+    if sender.send(parse_stack(data)).is_err() {
+        // The receiver is gone, stop consuming
+        return -1;
+    }
+    0
+}
+
+// A libbpf ring buffer consuming a single shard. libbpf-rs' `RingBuffer`
+// borrows its map and can't be sent to another thread, so the shards use
+// libbpf directly.
+struct ShardRingBuffer {
+    ring_buffer: *mut libbpf_sys::ring_buffer,
+    sender: *mut Sender<RubyStack>,
+}
+
+// The ring buffer is only ever used by the thread it's moved into.
+unsafe impl Send for ShardRingBuffer {}
+
+impl ShardRingBuffer {
+    fn new(map_fd: c_int, sender: Sender<RubyStack>) -> Result<Self> {
+        let sender = Box::into_raw(Box::new(sender));
+        let ring_buffer = unsafe {
+            libbpf_sys::ring_buffer__new(
+                map_fd,
+                Some(handle_sample),
+                sender as *mut c_void,
+                std::ptr::null(),
+            )
+        };
+        if ring_buffer.is_null() {
+            drop(unsafe { Box::from_raw(sender) });
+            return Err(anyhow!("ring_buffer__new failed with errno {}", errno()));
+        }
+        Ok(ShardRingBuffer {
+            ring_buffer,
+            sender,
+        })
+    }
+
+    fn poll(&self, timeout: Duration) {
+        let ret = unsafe {
+            libbpf_sys::ring_buffer__poll(self.ring_buffer, timeout.as_millis() as c_int)
+        };
+        if ret < 0 {
+            debug!("Polling ringbuf shard failed with {}", ret);
+        }
+    }
+
+    fn consume(&self) {
+        let ret = unsafe { libbpf_sys::ring_buffer__consume(self.ring_buffer) };
+        if ret < 0 {
+            debug!("Consuming ringbuf shard failed with {}", ret);
+        }
+    }
+}
+
+impl Drop for ShardRingBuffer {
+    fn drop(&mut self) {
+        unsafe {
+            libbpf_sys::ring_buffer__free(self.ring_buffer);
+            drop(Box::from_raw(self.sender));
+        }
+    }
+}
+
+/// Drains every ring buffer shard on its own thread, all of them feeding
+/// the same channel.
+pub struct ShardConsumers {
+    stop: Arc<AtomicBool>,
+    threads: Vec<JoinHandle<()>>,
+}
+
+impl ShardConsumers {
+    pub fn start(map_fds: &[c_int], sender: &Sender<RubyStack>, timeout: Duration) -> Result<Self> {
+        // Set up every shard before starting any thread so errors are
+        // reported early
+        let ring_buffers = map_fds
+            .iter()
+            .map(|&fd| ShardRingBuffer::new(fd, sender.clone()))
+            .collect::<Result<Vec<_>>>()?;
+
+        let stop = Arc::new(AtomicBool::new(false));
+        let mut threads = Vec::new();
+        for (shard, ring_buffer) in ring_buffers.into_iter().enumerate() {
+            let stop = stop.clone();
+            let thread = thread::Builder::new()
+                .name(format!("rbperf-shard-{}", shard))
+                .spawn(move || {
+                    while !stop.load(Ordering::SeqCst) {
+                        ring_buffer.poll(timeout);
+                        // With batched wakeups, poll can time out with
+                        // samples pending below the threshold
+                        ring_buffer.consume();
+                    }
+                    ring_buffer.consume();
+                })?;
+            threads.push(thread);
+        }
+        Ok(ShardConsumers { stop, threads })
+    }
+
+    /// Stops the consumers once they've drained their shard.
+    pub fn stop(self) {
+        self.stop.store(true, Ordering::SeqCst);
+        for thread in self.threads {
+            if thread.join().is_err() {
+                error!("ringbuf shard consumer panicked");
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_shard_map_name() {
+        assert_eq!(shard_map_name(0), "events");
+        assert_eq!(shard_map_name(3), "events_3");
+    }
+}
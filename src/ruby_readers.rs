@@ -71,9 +71,12 @@ mod tests {
 
         let ruby_stack = RubyStack {
             timestamp: 101,
+            weight: 1,
             frames: stack,
             pid: 5,
             cpu: 1,
+            during_gc: 0,
+            id_generation: 0,
             size: 2,
             expected_size: 2,
             comm: test_comm,
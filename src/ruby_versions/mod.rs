@@ -1,3 +1,7 @@
+use anyhow::Result;
+
+use crate::RubyVersionOffsets;
+
 pub const ruby_2_6_0: &str = include_str!("ruby_2_6_0.yaml");
 pub const ruby_2_6_3: &str = include_str!("ruby_2_6_3.yaml");
 pub const ruby_2_7_1: &str = include_str!("ruby_2_7_1.yaml");
@@ -6,3 +10,23 @@ pub const ruby_2_7_6: &str = include_str!("ruby_2_7_6.yaml");
 pub const ruby_3_0_0: &str = include_str!("ruby_3_0_0.yaml");
 pub const ruby_3_0_4: &str = include_str!("ruby_3_0_4.yaml");
 pub const ruby_3_1_2: &str = include_str!("ruby_3_1_2.yaml");
+
+// Indexed by the version ids stored in BPF.
+pub const ruby_version_configs: [&str; 8] = [
+    ruby_2_6_0, ruby_2_6_3, ruby_2_7_1, ruby_2_7_4, ruby_2_7_6, ruby_3_0_0, ruby_3_0_4, ruby_3_1_2,
+];
+
+/// Offsets for a `major.minor.patch` Ruby version, if it's supported.
+pub fn offsets_for_version(ruby_version: &str) -> Result<Option<RubyVersionOffsets>> {
+    for config in ruby_version_configs {
+        let offsets: RubyVersionOffsets = serde_yaml::from_str(config)?;
+        let version = format!(
+            "{}.{}.{}",
+            offsets.major_version, offsets.minor_version, offsets.patch_version
+        );
+        if version == ruby_version {
+            return Ok(Some(offsets));
+        }
+    }
+    Ok(None)
+}
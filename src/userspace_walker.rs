@@ -0,0 +1,444 @@
+use std::collections::HashMap;
+use std::fs;
+use std::io::IoSliceMut;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, Instant};
+
+use anyhow::{anyhow, Result};
+use log::debug;
+use nix::errno::Errno;
+use nix::sys::uio::{process_vm_readv, RemoteIoVec};
+use nix::unistd::Pid as NixPid;
+use proc_maps::Pid;
+use thiserror::Error;
+
+use crate::process::ProcessInfo;
+use crate::profile::Profile;
+use crate::ruby_versions::offsets_for_version;
+use crate::{
+    as_offset, body_offset, iseq_offset, path_offset, rb_value_sizeof, ruby_location_offset,
+    RubyVersionOffsets, COMM_MAXLEN, MAX_STACK, PATH_MAXLEN, PATH_TYPE_OFFSET, RUBY_T_ARRAY,
+    RUBY_T_MASK, RUBY_T_STRING,
+};
+
+// Most iovecs a single process_vm_readv call accepts.
+const IOV_MAX: usize = 1024;
+// Set in a Ruby string's flags when its contents live on the heap.
+const STRING_ON_HEAP: u64 = 1 << 13;
+const NATIVE_METHOD_NAME: &str = "<native code>";
+
+#[derive(Error, Debug, PartialEq, Eq)]
+pub enum WalkError {
+    #[error("the process exited")]
+    ProcessExited,
+    #[error("could not read memory at 0x{address:x}")]
+    Read { address: u64 },
+    #[error("a frame's path is neither a string nor an array")]
+    WrongFrameType,
+    #[error("the stack is deeper than {} frames", MAX_STACK)]
+    Incomplete,
+}
+
+/// Reads the memory of another process with process_vm_readv(2), many
+/// addresses per call.
+pub struct ProcessMemory {
+    pid: NixPid,
+}
+
+impl ProcessMemory {
+    pub fn new(pid: Pid) -> Self {
+        ProcessMemory {
+            pid: NixPid::from_raw(pid),
+        }
+    }
+
+    // Fills every buffer from its address in a single call, returning how
+    // many bytes were read. Reading stops at the first address that fails.
+    fn read_batch(&self, reads: &mut [(u64, &mut [u8])]) -> Result<usize, WalkError> {
+        let remote: Vec<RemoteIoVec> = reads
+            .iter()
+            .map(|(address, buffer)| RemoteIoVec {
+                base: *address as usize,
+                len: buffer.len(),
+            })
+            .collect();
+        let mut local: Vec<IoSliceMut> = reads
+            .iter_mut()
+            .map(|(_, buffer)| IoSliceMut::new(buffer))
+            .collect();
+        match process_vm_readv(self.pid, &mut local, &remote) {
+            Ok(read) => Ok(read),
+            Err(Errno::ESRCH) => Err(WalkError::ProcessExited),
+            Err(err) => {
+                debug!("process_vm_readv failed with {}", err);
+                Err(WalkError::Read {
+                    address: reads.first().map_or(0, |(address, _)| *address),
+                })
+            }
+        }
+    }
+
+    pub fn read(&self, address: u64, buffer: &mut [u8]) -> Result<(), WalkError> {
+        let len = buffer.len();
+        if self.read_batch(&mut [(address, buffer)])? < len {
+            return Err(WalkError::Read { address });
+        }
+        Ok(())
+    }
+
+    pub fn read_u64(&self, address: u64) -> Result<u64, WalkError> {
+        Ok(self.read_u64s(&[address])?[0])
+    }
+
+    pub fn read_u64s(&self, addresses: &[u64]) -> Result<Vec<u64>, WalkError> {
+        let mut values = Vec::with_capacity(addresses.len());
+        for addresses in addresses.chunks(IOV_MAX) {
+            let mut buffer = vec![0u8; addresses.len() * 8];
+            let mut reads: Vec<(u64, &mut [u8])> = addresses
+                .iter()
+                .copied()
+                .zip(buffer.chunks_mut(8))
+                .collect();
+            let read = self.read_batch(&mut reads)?;
+            if read < buffer.len() {
+                return Err(WalkError::Read {
+                    address: addresses[read / 8],
+                });
+            }
+            values.extend(
+                buffer
+                    .chunks(8)
+                    .map(|value| u64::from_le_bytes(value.try_into().unwrap())),
+            );
+        }
+        Ok(values)
+    }
+
+    // Reads the NUL terminated strings at `addresses`, up to `max_len`
+    // bytes each. A string may end right before an unmapped page, so reads
+    // are only retried one by one if the batch fails.
+    fn read_strs(&self, addresses: &[u64], max_len: usize) -> Result<Vec<String>, WalkError> {
+        let mut buffers = vec![vec![0u8; max_len]; addresses.len()];
+        let mut complete = true;
+        for (addresses, buffers) in addresses.chunks(IOV_MAX).zip(buffers.chunks_mut(IOV_MAX)) {
+            let mut reads: Vec<(u64, &mut [u8])> = addresses
+                .iter()
+                .copied()
+                .zip(buffers.iter_mut().map(|buffer| buffer.as_mut_slice()))
+                .collect();
+            complete &= self.read_batch(&mut reads)? == addresses.len() * max_len;
+        }
+        if !complete {
+            for (&address, buffer) in addresses.iter().zip(buffers.iter_mut()) {
+                let read = self.read_batch(&mut [(address, buffer.as_mut_slice())])?;
+                if read == 0 {
+                    return Err(WalkError::Read { address });
+                }
+                buffer.truncate(read);
+            }
+        }
+        Ok(buffers
+            .iter()
+            .map(|buffer| {
+                let end = buffer.iter().position(|&c| c == 0).unwrap_or(buffer.len());
+                String::from_utf8_lossy(&buffer[..end]).into_owned()
+            })
+            .collect())
+    }
+}
+
+/// Walks the Ruby stack of a process from userspace, following the same
+/// steps and offsets as the BPF walker. It's a fallback for hosts where
+/// BPF can't be used, and an independent implementation to check the BPF
+/// walker against.
+///
+/// Every step reads all the frames at once, so a walk takes the same
+/// handful of process_vm_readv calls however deep the stack is.
+pub struct StackWalker {
+    pid: Pid,
+    comm: String,
+    memory: ProcessMemory,
+    offsets: RubyVersionOffsets,
+    rb_frame_addr: u64,
+}
+
+impl StackWalker {
+    pub fn new(process_info: &ProcessInfo) -> Result<Self> {
+        let offsets = offsets_for_version(&process_info.ruby_version)?.ok_or_else(|| {
+            anyhow!(
+                "Ruby {} is not supported by the userspace walker",
+                process_info.ruby_version
+            )
+        })?;
+        let comm = fs::read_to_string(format!("/proc/{}/comm", process_info.pid))?;
+        Ok(StackWalker {
+            pid: process_info.pid,
+            // Same as the comm BPF reads
+            comm: comm
+                .trim_end()
+                .chars()
+                .take(COMM_MAXLEN as usize - 1)
+                .collect(),
+            memory: ProcessMemory::new(process_info.pid),
+            offsets,
+            rb_frame_addr: process_info.ruby_main_thread_address(),
+        })
+    }
+
+    pub fn pid(&self) -> Pid {
+        self.pid
+    }
+
+    pub fn comm(&self) -> &str {
+        &self.comm
+    }
+
+    /// Returns the (method name, path) of each frame, starting with the
+    /// innermost, as `Decoder` does for BPF stacks.
+    pub fn walk(&self) -> Result<Vec<(String, String)>, WalkError> {
+        let offsets = &self.offsets;
+        let vm = self.memory.read_u64(self.rb_frame_addr)?;
+        let main_thread = self
+            .memory
+            .read_u64(vm + offsets.main_thread_offset as u64)?;
+        let ec = self
+            .memory
+            .read_u64(main_thread + offsets.ec_offset as u64)?;
+        let ec_fields = self.memory.read_u64s(&[
+            ec + offsets.vm_offset as u64,
+            ec + offsets.vm_size_offset as u64,
+            ec + offsets.cfp_offset as u64,
+        ])?;
+        let (stack, stack_size, cfp) = (ec_fields[0], ec_fields[1], ec_fields[2]);
+
+        let frame_size = offsets.control_frame_t_sizeof as u64;
+        // Skip the two dummy frames at the base of the stack
+        let base_stack =
+            (stack + rb_value_sizeof as u64 * stack_size).saturating_sub(2 * frame_size);
+        // BPF starts with the frame after the current one
+        let first = cfp + frame_size;
+        if first > base_stack {
+            return Ok(Vec::new());
+        }
+        let frame_count = ((base_stack - first) / frame_size + 1) as usize;
+        if frame_count > MAX_STACK as usize {
+            return Err(WalkError::Incomplete);
+        }
+
+        let mut control_frames = vec![0u8; frame_count * frame_size as usize];
+        self.memory.read(first, &mut control_frames)?;
+        let iseqs: Vec<u64> = control_frames
+            .chunks(frame_size as usize)
+            .map(|frame| {
+                let iseq = &frame[iseq_offset as usize..iseq_offset as usize + 8];
+                u64::from_le_bytes(iseq.try_into().unwrap())
+            })
+            .collect();
+
+        // Frames without an iseq are native
+        let ruby_iseqs: Vec<u64> = iseqs.iter().copied().filter(|&iseq| iseq != 0).collect();
+        let bodies = self.memory.read_u64s(
+            &ruby_iseqs
+                .iter()
+                .map(|iseq| iseq + body_offset as u64)
+                .collect::<Vec<_>>(),
+        )?;
+        let location = (ruby_location_offset + path_offset) as u64;
+        let label_offset = (ruby_location_offset as i32 + offsets.label_offset) as u64;
+        let mut location_addresses = Vec::with_capacity(bodies.len() * 2);
+        for body in &bodies {
+            location_addresses.push(body + location);
+            location_addresses.push(body + label_offset);
+        }
+        let locations = self.memory.read_u64s(&location_addresses)?;
+        let (path_values, labels): (Vec<u64>, Vec<u64>) = locations
+            .chunks(2)
+            .map(|location| (location[0], location[1]))
+            .unzip();
+        let paths = self.resolve_paths(&path_values)?;
+        let strings = self.read_ruby_strs(paths.iter().chain(labels.iter()).copied())?;
+
+        let mut frames = Vec::with_capacity(frame_count);
+        let mut ruby_frames = paths.iter().zip(labels.iter());
+        for iseq in iseqs {
+            if iseq == 0 {
+                // Native frames have no path, like in BPF
+                frames.push((NATIVE_METHOD_NAME.to_string(), String::new()));
+                continue;
+            }
+            let (path_address, label_address) = ruby_frames.next().unwrap();
+            frames.push((
+                strings[label_address].clone(),
+                strings[path_address].clone(),
+            ));
+        }
+        Ok(frames)
+    }
+
+    // Turns the path values of the iseqs into the addresses of their path
+    // strings. Depending on the Ruby version, the path is either a string or
+    // an array holding the relative and absolute paths.
+    fn resolve_paths(&self, path_values: &[u64]) -> Result<Vec<u64>, WalkError> {
+        let flags = self.memory.read_u64s(path_values)?;
+        let mut paths = path_values.to_vec();
+        let mut arrays = Vec::new();
+        for (i, flags) in flags.iter().enumerate() {
+            match flags & RUBY_T_MASK as u64 {
+                t if t == RUBY_T_STRING as u64 => {}
+                t if t == RUBY_T_ARRAY as u64 => {
+                    if self.offsets.path_flavour == 1 {
+                        arrays.push(i);
+                    }
+                }
+                _ => return Err(WalkError::WrongFrameType),
+            }
+        }
+        let array_paths = self.memory.read_u64s(
+            &arrays
+                .iter()
+                .map(|&i| path_values[i] + as_offset as u64 + PATH_TYPE_OFFSET as u64)
+                .collect::<Vec<_>>(),
+        )?;
+        for (i, path) in arrays.into_iter().zip(array_paths) {
+            paths[i] = path;
+        }
+        Ok(paths)
+    }
+
+    // Reads the Ruby strings at `addresses`, by address. They are read on
+    // every walk, as the GC can free or compact a string and reuse its
+    // address for another one.
+    fn read_ruby_strs(
+        &self,
+        addresses: impl Iterator<Item = u64>,
+    ) -> Result<HashMap<u64, String>, WalkError> {
+        let mut unique: Vec<u64> = addresses.collect();
+        if unique.is_empty() {
+            return Ok(HashMap::new());
+        }
+        unique.sort_unstable();
+        unique.dedup();
+
+        let flags = self.memory.read_u64s(&unique)?;
+        let embedded = |address: u64| address + as_offset as u64;
+        let on_heap: Vec<usize> = (0..unique.len())
+            .filter(|&i| flags[i] & STRING_ON_HEAP != 0)
+            .collect();
+        let heap_pointers = self.memory.read_u64s(
+            &on_heap
+                .iter()
+                // The pointer follows the length
+                .map(|&i| embedded(unique[i]) + 8)
+                .collect::<Vec<_>>(),
+        )?;
+        let mut contents: Vec<u64> = unique.iter().map(|&address| embedded(address)).collect();
+        for (i, pointer) in on_heap.into_iter().zip(heap_pointers) {
+            contents[i] = pointer;
+        }
+
+        // Leave room for the NUL, as BPF does
+        let strings = self.memory.read_strs(&contents, PATH_MAXLEN as usize - 1)?;
+        Ok(unique.into_iter().zip(strings).collect())
+    }
+}
+
+#[derive(Default, Debug)]
+pub struct WalkerStats {
+    pub samples: u32,
+    pub read_errors: u32,
+    pub wrong_frame_type_errors: u32,
+    pub incomplete_stack_errors: u32,
+    // Time spent walking stacks, to compare with the BPF programs' runtime.
+    pub walk_time: Duration,
+}
+
+impl WalkerStats {
+    pub fn total_errors(&self) -> u32 {
+        self.read_errors + self.wrong_frame_type_errors + self.incomplete_stack_errors
+    }
+
+    pub fn mean_walk_time(&self) -> Duration {
+        let walks = self.samples + self.total_errors();
+        if walks == 0 {
+            return Duration::ZERO;
+        }
+        self.walk_time / walks
+    }
+}
+
+/// Samples the stacks of every walker `sample_rate` times per second of
+/// wall-clock time, adding them to `profile`. Processes that exit are no
+/// longer sampled.
+pub fn profile(
+    mut walkers: Vec<StackWalker>,
+    sample_rate: u32,
+    duration: Duration,
+    profile: &mut Profile,
+    runnable: Arc<AtomicBool>,
+) -> WalkerStats {
+    let mut stats = WalkerStats::default();
+    let interval = Duration::from_secs(1) / sample_rate.max(1);
+    let started_at = Instant::now();
+    let mut next_sample = started_at;
+
+    while !walkers.is_empty() && started_at.elapsed() < duration && runnable.load(Ordering::SeqCst)
+    {
+        let mut exited = Vec::new();
+        for (i, walker) in walkers.iter().enumerate() {
+            let walk_started_at = Instant::now();
+            let result = walker.walk();
+            stats.walk_time += walk_started_at.elapsed();
+            match result {
+                Ok(frames) => {
+                    stats.samples += 1;
+                    profile.add_sample(walker.pid(), walker.comm().to_string(), frames);
+                }
+                Err(WalkError::ProcessExited) => exited.push(i),
+                Err(WalkError::Read { address }) => {
+                    debug!("reading 0x{:x} failed", address);
+                    stats.read_errors += 1;
+                }
+                Err(WalkError::WrongFrameType) => stats.wrong_frame_type_errors += 1,
+                Err(WalkError::Incomplete) => stats.incomplete_stack_errors += 1,
+            }
+        }
+        for i in exited.into_iter().rev() {
+            debug!("process {} exited", walkers[i].pid());
+            walkers.remove(i);
+        }
+
+        // Skip the samples we're late for rather than catching up in a burst
+        next_sample += interval;
+        let now = Instant::now();
+        if next_sample > now {
+            thread::sleep(next_sample - now);
+        } else {
+            next_sample = now;
+        }
+    }
+    stats
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_read_own_memory() {
+        let memory = ProcessMemory::new(std::process::id() as Pid);
+        let values: [u64; 3] = [1, u64::MAX, 42];
+        let text = b"method_name\0garbage";
+        let addresses: Vec<u64> = values.iter().map(|v| v as *const u64 as u64).collect();
+
+        assert_eq!(memory.read_u64s(&addresses).unwrap(), values);
+        assert_eq!(
+            memory
+                .read_strs(&[text.as_ptr() as u64], PATH_MAXLEN as usize - 1)
+                .unwrap(),
+            vec!["method_name".to_string()]
+        );
+        assert_eq!(memory.read_u64(0), Err(WalkError::Read { address: 0 }));
+    }
+}
@@ -0,0 +1,176 @@
+use log::{info, warn};
+
+// Longest sample period the watchdog will set, as a multiple of the
+// configured one, before disabling the events altogether.
+const MAX_PERIOD_FACTOR: u64 = 64;
+// How many intervals the events stay disabled before trying again.
+const DISABLED_INTERVALS: u32 = 5;
+
+#[derive(Debug, PartialEq, Eq)]
+pub enum WatchdogAction {
+    SetSamplePeriod(u64),
+    Disable,
+    Enable,
+}
+
+/// Keeps rbperf's CPU usage under a budget, and the share of samples lost
+/// because the buffers are full under a limit, by lengthening the sample
+/// period of the perf events, or as a last resort disabling them. This is
+/// undone once both are back under their limits.
+pub struct Watchdog {
+    // Fraction of the host's CPU time rbperf may use.
+    budget: Option<f64>,
+    // Fraction of the samples that may be lost.
+    max_loss_ratio: Option<f64>,
+    // None for events without a sample period, such as tracepoints.
+    base_period: Option<u64>,
+    period: u64,
+    disabled_for: Option<u32>,
+}
+
+impl Watchdog {
+    pub fn new(
+        budget_percent: Option<f64>,
+        max_loss_ratio: Option<f64>,
+        sample_period: Option<u64>,
+    ) -> Self {
+        Watchdog {
+            budget: budget_percent.map(|budget| budget / 100.0),
+            max_loss_ratio,
+            base_period: sample_period,
+            period: sample_period.unwrap_or(0),
+            disabled_for: None,
+        }
+    }
+
+    pub fn sample_period(&self) -> Option<u64> {
+        self.base_period.map(|_| self.period)
+    }
+
+    /// `usage` is the fraction of the host's CPU time used by rbperf and
+    /// `loss_ratio` the fraction of samples lost since the previous call.
+    pub fn observe(&mut self, usage: f64, loss_ratio: f64) -> Option<WatchdogAction> {
+        if let Some(intervals) = self.disabled_for {
+            if intervals + 1 < DISABLED_INTERVALS {
+                self.disabled_for = Some(intervals + 1);
+                return None;
+            }
+            info!("watchdog: enabling events again");
+            self.disabled_for = None;
+            return Some(WatchdogAction::Enable);
+        }
+
+        let over_budget = self.budget.map_or(false, |budget| usage > budget);
+        let over_loss_ratio = self
+            .max_loss_ratio
+            .map_or(false, |max_loss_ratio| loss_ratio > max_loss_ratio);
+        if over_budget || over_loss_ratio {
+            let reason = if over_budget {
+                format!("CPU usage {:.3}% over budget", usage * 100.0)
+            } else {
+                format!("{:.2}% of the samples lost", loss_ratio * 100.0)
+            };
+            if let Some(base_period) = self.base_period {
+                let max_period = base_period * MAX_PERIOD_FACTOR;
+                if self.period < max_period {
+                    self.period = (self.period * 2).min(max_period);
+                    warn!("watchdog: {}, sample period set to {}", reason, self.period);
+                    return Some(WatchdogAction::SetSamplePeriod(self.period));
+                }
+            }
+            warn!("watchdog: {}, disabling events", reason);
+            self.disabled_for = Some(0);
+            return Some(WatchdogAction::Disable);
+        }
+
+        // Only restore once well under the limits, so we don't flip back
+        // and forth around them
+        let under_budget = self.budget.map_or(true, |budget| usage < budget / 2.0);
+        let under_loss_ratio = self
+            .max_loss_ratio
+            .map_or(true, |max_loss_ratio| loss_ratio < max_loss_ratio / 2.0);
+        if let Some(base_period) = self.base_period {
+            if under_budget && under_loss_ratio && self.period > base_period {
+                self.period = (self.period / 2).max(base_period);
+                info!("watchdog: sample period restored to {}", self.period);
+                return Some(WatchdogAction::SetSamplePeriod(self.period));
+            }
+        }
+        None
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_under_budget_does_nothing() {
+        let mut watchdog = Watchdog::new(Some(1.0), None, Some(1000));
+        assert_eq!(watchdog.observe(0.005, 0.0), None);
+        assert_eq!(watchdog.sample_period(), Some(1000));
+    }
+
+    #[test]
+    fn test_throttles_and_restores_period() {
+        let mut watchdog = Watchdog::new(Some(1.0), None, Some(1000));
+        assert_eq!(
+            watchdog.observe(0.02, 0.0),
+            Some(WatchdogAction::SetSamplePeriod(2000))
+        );
+        assert_eq!(
+            watchdog.observe(0.02, 0.0),
+            Some(WatchdogAction::SetSamplePeriod(4000))
+        );
+        // Between half the budget and the budget, keep the period
+        assert_eq!(watchdog.observe(0.008, 0.0), None);
+        assert_eq!(
+            watchdog.observe(0.001, 0.0),
+            Some(WatchdogAction::SetSamplePeriod(2000))
+        );
+        assert_eq!(
+            watchdog.observe(0.001, 0.0),
+            Some(WatchdogAction::SetSamplePeriod(1000))
+        );
+        assert_eq!(watchdog.observe(0.001, 0.0), None);
+    }
+
+    #[test]
+    fn test_disables_at_max_period() {
+        let mut watchdog = Watchdog::new(Some(1.0), None, Some(1000));
+        for _ in 0..6 {
+            assert!(matches!(
+                watchdog.observe(0.5, 0.0),
+                Some(WatchdogAction::SetSamplePeriod(_))
+            ));
+        }
+        assert_eq!(watchdog.sample_period(), Some(64000));
+        assert_eq!(watchdog.observe(0.5, 0.0), Some(WatchdogAction::Disable));
+        for _ in 0..DISABLED_INTERVALS - 1 {
+            assert_eq!(watchdog.observe(0.0, 0.0), None);
+        }
+        assert_eq!(watchdog.observe(0.0, 0.0), Some(WatchdogAction::Enable));
+    }
+
+    #[test]
+    fn test_throttles_on_losses() {
+        let mut watchdog = Watchdog::new(None, Some(0.01), Some(1000));
+        assert_eq!(watchdog.observe(0.5, 0.0), None);
+        assert_eq!(
+            watchdog.observe(0.0, 0.1),
+            Some(WatchdogAction::SetSamplePeriod(2000))
+        );
+        assert_eq!(watchdog.observe(0.0, 0.008), None);
+        assert_eq!(
+            watchdog.observe(0.0, 0.0),
+            Some(WatchdogAction::SetSamplePeriod(1000))
+        );
+    }
+
+    #[test]
+    fn test_events_without_period_are_disabled() {
+        let mut watchdog = Watchdog::new(Some(1.0), None, None);
+        assert_eq!(watchdog.observe(0.5, 0.0), Some(WatchdogAction::Disable));
+        assert_eq!(watchdog.sample_period(), None);
+    }
+}
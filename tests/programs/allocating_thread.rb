@@ -0,0 +1,17 @@
+def allocate
+  10_000.times.map { 'x' * 100 }
+end
+
+def work
+  while true
+    allocate
+    sleep 0.01
+  end
+end
+
+$stdout.sync = true
+puts "PID: #{Process.pid}"
+
+# The main thread only waits, the allocations and GCs happen in the worker
+worker = Thread.new { work }
+worker.join
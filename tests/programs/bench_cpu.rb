@@ -0,0 +1,77 @@
+# cpu_hog.rb's loop, run for a fixed time, reporting how many iterations
+# it managed and their latency percentiles.
+def cpu
+  (0..1000).each do
+  end
+end
+
+def hog
+  (0..1000).each do
+  end
+end
+
+def program
+  (0..1000).each do
+  end
+end
+
+def c1
+  cpu
+end
+
+def b1
+  c1
+end
+
+def a1
+  b1
+end
+
+def c2
+  hog
+end
+
+def b2
+  c2
+end
+
+def a2
+  b2
+end
+
+def c3
+  program
+end
+
+def b3
+  c3
+end
+
+def a3
+  b3
+end
+
+def percentile(sorted, p)
+  return 0 if sorted.empty?
+  rank = ((p / 100.0) * sorted.size).ceil
+  sorted[rank.clamp(1, sorted.size) - 1]
+end
+
+duration = Float(ARGV[0] || 10)
+$stdout.sync = true
+puts "PID: #{Process.pid}"
+# Give the profiler time to attach
+$stdin.gets
+
+latencies = []
+deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + duration
+while (now = Process.clock_gettime(Process::CLOCK_MONOTONIC)) < deadline
+  a1
+  a2
+  a3
+  latencies << Process.clock_gettime(Process::CLOCK_MONOTONIC) - now
+end
+
+latencies.sort!
+puts "iterations=#{latencies.size} p50_us=#{(percentile(latencies, 50) * 1e6).round(2)} " \
+     "p99_us=#{(percentile(latencies, 99) * 1e6).round(2)} p999_us=#{(percentile(latencies, 99.9) * 1e6).round(2)}"
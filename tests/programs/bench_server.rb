@@ -0,0 +1,41 @@
+# Same handler as server.rb, served with the standard library only so the
+# overhead benchmark doesn't need any gems.
+require 'socket'
+
+def c
+  i = 0
+  (0..1000).each do |n|
+    i *= n + 3
+    f = File.open('/')
+    f.close
+  end
+end
+
+def b
+  c
+end
+
+def a
+  b
+end
+
+port = Integer(ARGV[0] || 9494)
+server = TCPServer.new('127.0.0.1', port)
+$stdout.sync = true
+puts "PID: #{Process.pid}"
+
+loop do
+  Thread.new(server.accept) do |client|
+    request_line = client.gets
+    # Skip the headers
+    while (line = client.gets) && line != "\r\n"
+    end
+    if request_line&.start_with?('GET / ')
+      a
+      client.write("HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nhi")
+    else
+      client.write("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n")
+    end
+    client.close
+  end
+end
@@ -0,0 +1,17 @@
+def spin
+  (0..100_000).each do
+  end
+end
+
+def contend
+  while true
+    spin
+  end
+end
+
+$stdout.sync = true
+puts "PID: #{Process.pid}"
+
+# Two CPU bound threads, each waiting for the GVL while the other holds it
+threads = 2.times.map { Thread.new { contend } }
+threads.each(&:join)
@@ -0,0 +1,20 @@
+def write_null(file)
+  file.write('x')
+end
+
+def work
+  File.open('/dev/null', 'w') do |file|
+    file.sync = true
+    while true
+      write_null(file)
+      sleep 0.01
+    end
+  end
+end
+
+$stdout.sync = true
+puts "PID: #{Process.pid}"
+
+# The main thread only waits, the native calls happen in the worker
+worker = Thread.new { work }
+worker.join
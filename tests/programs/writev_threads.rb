@@ -0,0 +1,34 @@
+# Calls writev(2) from many threads, optionally capped to a total rate of
+# calls per second, to stress the event emit path.
+threads = Integer(ARGV[0] || 32)
+rate = Integer(ARGV[1] || 0)
+# Writes are issued in batches every tick to keep sleeping cheap.
+tick = 0.01
+
+def emit(io)
+  # More than one string makes IO#write use writev
+  io.write('a', 'b')
+end
+
+$stdout.sync = true
+puts "PID: #{Process.pid}"
+
+workers = threads.times.map do
+  Thread.new do
+    io = File.open(File::NULL, 'w')
+    io.sync = true
+    if rate.zero?
+      loop { emit(io) }
+    else
+      batch = [(rate * tick / threads).round, 1].max
+      next_tick = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      loop do
+        batch.times { emit(io) }
+        next_tick += tick
+        delay = next_tick - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        sleep(delay) if delay > 0
+      end
+    end
+  end
+end
+workers.each(&:join)
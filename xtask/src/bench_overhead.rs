@@ -0,0 +1,405 @@
+//! Measures how much rbperf slows down the program it profiles.
+//!
+//! Every workload is run without a profiler and then under each profiler
+//! configuration, reporting throughput and latency percentiles so they can
+//! be compared against the baseline. Everything runs locally, the HTTP
+//! workload is driven over loopback.
+
+use std::fs;
+use std::io::{BufRead, BufReader, Read, Write};
+use std::net::{TcpListener, TcpStream};
+use std::path::PathBuf;
+use std::process::{Child, ChildStdout, Command, Stdio};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use rbperf::overhead::percentile;
+use serde::Serialize;
+
+const HTTP_SERVER: &str = "tests/programs/bench_server.rb";
+const CPU_LOOP: &str = "tests/programs/bench_cpu.rb";
+// Loading the BPF programs and attaching to the process takes a moment.
+const PROFILER_STARTUP: Duration = Duration::from_secs(2);
+
+struct Options {
+    duration: Duration,
+    rbperf: PathBuf,
+    ruby: String,
+    sample_periods: Vec<u64>,
+    syscall: String,
+    userspace_sample_rate: u32,
+    clients: usize,
+    output: Option<PathBuf>,
+}
+
+impl Default for Options {
+    fn default() -> Self {
+        Options {
+            duration: Duration::from_secs(10),
+            rbperf: PathBuf::from("target/release/rbperf"),
+            ruby: "ruby".to_string(),
+            sample_periods: vec![999_999, 99_999, 9_999],
+            syscall: "enter_write".to_string(),
+            userspace_sample_rate: 99,
+            clients: 4,
+            output: None,
+        }
+    }
+}
+
+const USAGE: &str = "cargo xtask bench-overhead [options]
+
+Options:
+    --duration <seconds>       how long to run every workload for [10]
+    --rbperf <path>            rbperf binary [target/release/rbperf]
+    --ruby <path>              Ruby interpreter [ruby]
+    --periods <p1,p2,...>      CPU sample periods to measure [999999,99999,9999]
+    --syscall <name>           syscall to trace [enter_write]
+    --userspace-rate <hz>      sample rate of the userspace walker [99]
+    --clients <n>              concurrent HTTP clients [4]
+    --output <path>            also write the results as JSON";
+
+fn parse_args(args: &[String]) -> Result<Options, String> {
+    let mut options = Options::default();
+    let mut args = args.iter();
+    while let Some(arg) = args.next() {
+        let mut value = || {
+            args.next()
+                .cloned()
+                .ok_or_else(|| format!("{} needs a value", arg))
+        };
+        match arg.as_str() {
+            "--duration" => {
+                let seconds = value()?.parse().map_err(|_| "invalid --duration")?;
+                options.duration = Duration::from_secs(seconds);
+            }
+            "--rbperf" => options.rbperf = PathBuf::from(value()?),
+            "--ruby" => options.ruby = value()?,
+            "--periods" => {
+                options.sample_periods = value()?
+                    .split(',')
+                    .map(|period| period.parse())
+                    .collect::<Result<_, _>>()
+                    .map_err(|_| "invalid --periods")?;
+            }
+            "--syscall" => options.syscall = value()?,
+            "--userspace-rate" => {
+                options.userspace_sample_rate =
+                    value()?.parse().map_err(|_| "invalid --userspace-rate")?
+            }
+            "--clients" => options.clients = value()?.parse().map_err(|_| "invalid --clients")?,
+            "--output" => options.output = Some(PathBuf::from(value()?)),
+            "--help" | "-h" => return Err(USAGE.to_string()),
+            other => return Err(format!("unknown option {}\n\n{}", other, USAGE)),
+        }
+    }
+    Ok(options)
+}
+
+#[derive(Clone, Copy, Debug, Serialize)]
+enum Workload {
+    Http,
+    CpuLoop,
+}
+
+#[derive(Clone, Debug, Serialize)]
+enum Profiler {
+    None,
+    Cpu { sample_period: u64 },
+    Syscall { name: String },
+    Userspace { sample_rate: u32 },
+}
+
+impl Profiler {
+    fn label(&self) -> String {
+        match self {
+            Profiler::None => "no profiler".to_string(),
+            Profiler::Cpu { sample_period } => format!("cpu, period {}", sample_period),
+            Profiler::Syscall { name } => format!("syscall {}", name),
+            Profiler::Userspace { sample_rate } => format!("userspace, {} Hz", sample_rate),
+        }
+    }
+
+    fn start(&self, options: &Options, pid: u32) -> Option<Child> {
+        let mut command = Command::new(&options.rbperf);
+        // Outlive the measurement, it's stopped once it's done
+        let duration = options.duration + PROFILER_STARTUP * 2;
+        command.args([
+            "record",
+            "--pid",
+            &pid.to_string(),
+            "--duration",
+            &duration.as_secs().to_string(),
+        ]);
+        match self {
+            Profiler::None => return None,
+            Profiler::Cpu { sample_period } => {
+                command.args(["cpu", "--period", &sample_period.to_string()])
+            }
+            Profiler::Syscall { name } => command.args(["syscall", name]),
+            Profiler::Userspace { sample_rate } => command.args([
+                "--userspace",
+                "--sample-rate",
+                &sample_rate.to_string(),
+                "cpu",
+            ]),
+        };
+        // rbperf writes its profiles to the working directory
+        let child = command
+            .current_dir(std::env::temp_dir())
+            .stdout(Stdio::null())
+            .spawn()
+            .expect("failed to start rbperf, is --rbperf right?");
+        thread::sleep(PROFILER_STARTUP);
+        Some(child)
+    }
+}
+
+#[derive(Debug, Serialize)]
+struct Measurement {
+    workload: Workload,
+    profiler: Profiler,
+    // Requests or loop iterations per second.
+    throughput: f64,
+    p50_us: f64,
+    p99_us: f64,
+    p999_us: f64,
+    errors: u64,
+}
+
+// Waits for the "PID: <pid>" line the test programs print on start.
+fn read_pid(stdout: &mut BufReader<ChildStdout>) -> u32 {
+    let mut line = String::new();
+    stdout.read_line(&mut line).expect("failed to read the PID");
+    line.trim()
+        .strip_prefix("PID: ")
+        .and_then(|pid| pid.parse().ok())
+        .unwrap_or_else(|| panic!("unexpected output from the workload: {:?}", line))
+}
+
+fn free_port() -> u16 {
+    TcpListener::bind("127.0.0.1:0")
+        .unwrap()
+        .local_addr()
+        .unwrap()
+        .port()
+}
+
+fn http_request(port: u16) -> std::io::Result<()> {
+    let mut stream = TcpStream::connect(("127.0.0.1", port))?;
+    stream.write_all(b"GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")?;
+    let mut response = Vec::new();
+    stream.read_to_end(&mut response)?;
+    if !response.starts_with(b"HTTP/1.1 200") {
+        return Err(std::io::Error::new(
+            std::io::ErrorKind::Other,
+            "unexpected response",
+        ));
+    }
+    Ok(())
+}
+
+fn run_http(options: &Options, profiler: &Profiler) -> Measurement {
+    let port = free_port();
+    let mut server = Command::new(&options.ruby)
+        .args([HTTP_SERVER, &port.to_string()])
+        .stdout(Stdio::piped())
+        .spawn()
+        .expect("failed to start the server");
+    let pid = read_pid(&mut BufReader::new(server.stdout.take().unwrap()));
+    while TcpStream::connect(("127.0.0.1", port)).is_err() {
+        thread::sleep(Duration::from_millis(50));
+    }
+
+    let mut rbperf = profiler.start(options, pid);
+
+    let started_at = Instant::now();
+    let deadline = started_at + options.duration;
+    let results: Vec<(Vec<f64>, u64)> = thread::scope(|scope| {
+        let clients: Vec<_> = (0..options.clients)
+            .map(|_| {
+                scope.spawn(move || {
+                    let mut latencies = Vec::new();
+                    let mut errors = 0;
+                    while Instant::now() < deadline {
+                        let request_started_at = Instant::now();
+                        match http_request(port) {
+                            Ok(()) => {
+                                latencies.push(request_started_at.elapsed().as_secs_f64() * 1e6)
+                            }
+                            Err(_) => errors += 1,
+                        }
+                    }
+                    (latencies, errors)
+                })
+            })
+            .collect();
+        clients.into_iter().map(|c| c.join().unwrap()).collect()
+    });
+    let elapsed = started_at.elapsed();
+
+    stop(&mut rbperf);
+    server.kill().ok();
+    server.wait().ok();
+
+    let errors = results.iter().map(|(_, errors)| errors).sum();
+    let latencies: Vec<f64> = results.into_iter().flat_map(|(l, _)| l).collect();
+    Measurement {
+        workload: Workload::Http,
+        profiler: profiler.clone(),
+        throughput: latencies.len() as f64 / elapsed.as_secs_f64(),
+        p50_us: percentile(&latencies, 50.0),
+        p99_us: percentile(&latencies, 99.0),
+        p999_us: percentile(&latencies, 99.9),
+        errors,
+    }
+}
+
+fn run_cpu_loop(options: &Options, profiler: &Profiler) -> Measurement {
+    let mut program = Command::new(&options.ruby)
+        .args([CPU_LOOP, &options.duration.as_secs().to_string()])
+        .stdin(Stdio::piped())
+        .stdout(Stdio::piped())
+        .spawn()
+        .expect("failed to start the CPU loop");
+    let mut stdout = BufReader::new(program.stdout.take().unwrap());
+    let pid = read_pid(&mut stdout);
+
+    let mut rbperf = profiler.start(options, pid);
+
+    // The loop starts once we write a line
+    program
+        .stdin
+        .take()
+        .unwrap()
+        .write_all(b"\n")
+        .expect("failed to start the CPU loop");
+    let mut result = String::new();
+    stdout.read_line(&mut result).unwrap();
+    program.wait().ok();
+    stop(&mut rbperf);
+
+    // iterations=<n> p50_us=<us> p99_us=<us> p999_us=<us>
+    let field = |name: &str| -> f64 {
+        result
+            .split_whitespace()
+            .find_map(|pair| pair.strip_prefix(name)?.strip_prefix('='))
+            .and_then(|value| value.parse().ok())
+            .unwrap_or_else(|| panic!("unexpected output from the CPU loop: {:?}", result))
+    };
+    Measurement {
+        workload: Workload::CpuLoop,
+        profiler: profiler.clone(),
+        throughput: field("iterations") / options.duration.as_secs_f64(),
+        p50_us: field("p50_us"),
+        p99_us: field("p99_us"),
+        p999_us: field("p999_us"),
+        errors: 0,
+    }
+}
+
+fn stop(rbperf: &mut Option<Child>) {
+    if let Some(mut rbperf) = rbperf.take() {
+        // SIGINT, so rbperf cleans up like it would on Ctrl-C
+        unsafe { libc::kill(rbperf.id() as i32, libc::SIGINT) };
+        match rbperf.wait() {
+            Ok(status) if !status.success() => {
+                eprintln!("rbperf exited with {}, it needs to run as root", status)
+            }
+            Err(err) => eprintln!("waiting for rbperf failed with {}", err),
+            _ => {}
+        }
+    }
+}
+
+fn change(value: f64, baseline: f64) -> String {
+    if baseline == 0.0 {
+        return "-".to_string();
+    }
+    format!("{:+.2}%", (value - baseline) * 100.0 / baseline)
+}
+
+fn print_report(measurements: &[Measurement]) {
+    println!(
+        "{:<10} {:<24} {:>12} {:>9} {:>10} {:>10} {:>10} {:>9} {:>7}",
+        "workload",
+        "profiler",
+        "throughput/s",
+        "change",
+        "p50 us",
+        "p99 us",
+        "p99.9 us",
+        "p99 chg",
+        "errors"
+    );
+    for measurement in measurements {
+        // The first measurement of every workload has no profiler
+        let baseline = measurements
+            .iter()
+            .find(|m| {
+                std::mem::discriminant(&m.workload) == std::mem::discriminant(&measurement.workload)
+            })
+            .unwrap();
+        println!(
+            "{:<10} {:<24} {:>12.1} {:>9} {:>10.1} {:>10.1} {:>10.1} {:>9} {:>7}",
+            format!("{:?}", measurement.workload),
+            measurement.profiler.label(),
+            measurement.throughput,
+            change(measurement.throughput, baseline.throughput),
+            measurement.p50_us,
+            measurement.p99_us,
+            measurement.p999_us,
+            change(measurement.p99_us, baseline.p99_us),
+            measurement.errors
+        );
+    }
+}
+
+pub fn run(args: &[String]) {
+    let mut options = match parse_args(args) {
+        Ok(options) => options,
+        Err(message) => {
+            eprintln!("{}", message);
+            std::process::exit(1);
+        }
+    };
+    // rbperf runs from another directory
+    options.rbperf = fs::canonicalize(&options.rbperf).unwrap_or_else(|_| {
+        eprintln!(
+            "rbperf not found at {}, build it with cargo build --release",
+            options.rbperf.display()
+        );
+        std::process::exit(1);
+    });
+
+    let mut profilers = vec![Profiler::None];
+    profilers.extend(
+        options
+            .sample_periods
+            .iter()
+            .map(|&sample_period| Profiler::Cpu { sample_period }),
+    );
+    profilers.push(Profiler::Syscall {
+        name: options.syscall.clone(),
+    });
+    profilers.push(Profiler::Userspace {
+        sample_rate: options.userspace_sample_rate,
+    });
+
+    let mut measurements = Vec::new();
+    for workload in [Workload::Http, Workload::CpuLoop] {
+        for profiler in &profilers {
+            eprintln!("running {:?} with {}", workload, profiler.label());
+            measurements.push(match workload {
+                Workload::Http => run_http(&options, profiler),
+                Workload::CpuLoop => run_cpu_loop(&options, profiler),
+            });
+        }
+    }
+
+    print_report(&measurements);
+    if let Some(output) = &options.output {
+        fs::write(output, serde_json::to_string_pretty(&measurements).unwrap())
+            .expect("failed to write the results");
+    }
+}
@@ -42,6 +42,12 @@ fn dump_ruby_structs_ruby_2_6_0() {
     let main_thread_offset: i32 =
         offset_of!(rbspy_ruby_structs::ruby_2_6_0::rb_vm_struct, main_thread) as i32;
 
+    let thread_ec_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_6_0::rb_thread_struct, ec) as i32;
+
+    let objspace_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_6_0::rb_vm_struct, objspace) as i32;
+
     let ruby_2_6_0_offsets = RubyVersionOffsets {
         major_version: 2,
         minor_version: 6,
@@ -57,6 +63,8 @@ fn dump_ruby_structs_ruby_2_6_0() {
         lineno_offset: 0,
         main_thread_offset,
         ec_offset: 32,
+        thread_ec_offset,
+        objspace_offset,
     };
 
     let yaml = serde_yaml::to_string(&ruby_2_6_0_offsets).unwrap();
@@ -105,6 +113,12 @@ fn dump_ruby_structs_ruby_2_6_3() {
     let main_thread_offset: i32 =
         offset_of!(rbspy_ruby_structs::ruby_2_6_3::rb_vm_struct, main_thread) as i32;
 
+    let thread_ec_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_6_3::rb_thread_struct, ec) as i32;
+
+    let objspace_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_6_3::rb_vm_struct, objspace) as i32;
+
     let ruby_2_6_0_offsets = RubyVersionOffsets {
         major_version: 2,
         minor_version: 6,
@@ -120,6 +134,8 @@ fn dump_ruby_structs_ruby_2_6_3() {
         lineno_offset: 0,
         main_thread_offset,
         ec_offset: 32,
+        thread_ec_offset,
+        objspace_offset,
     };
 
     let yaml = serde_yaml::to_string(&ruby_2_6_0_offsets).unwrap();
@@ -168,6 +184,12 @@ fn dump_ruby_structs_ruby_2_7_1() {
     let main_thread_offset: i32 =
         offset_of!(rbspy_ruby_structs::ruby_2_7_1::rb_vm_struct, main_thread) as i32;
 
+    let thread_ec_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_7_1::rb_thread_struct, ec) as i32;
+
+    let objspace_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_7_1::rb_vm_struct, objspace) as i32;
+
     let ruby_2_7_1_offsets = RubyVersionOffsets {
         major_version: 2,
         minor_version: 7,
@@ -183,6 +205,8 @@ fn dump_ruby_structs_ruby_2_7_1() {
         lineno_offset: 0,
         main_thread_offset,
         ec_offset: 32,
+        thread_ec_offset,
+        objspace_offset,
     };
 
     let yaml = serde_yaml::to_string(&ruby_2_7_1_offsets).unwrap();
@@ -231,6 +255,12 @@ fn dump_ruby_structs_ruby_2_7_4() {
     let main_thread_offset: i32 =
         offset_of!(rbspy_ruby_structs::ruby_2_7_4::rb_vm_struct, main_thread) as i32;
 
+    let thread_ec_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_7_4::rb_thread_struct, ec) as i32;
+
+    let objspace_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_7_4::rb_vm_struct, objspace) as i32;
+
     let ruby_2_7_4_offsets = RubyVersionOffsets {
         major_version: 2,
         minor_version: 7,
@@ -246,6 +276,8 @@ fn dump_ruby_structs_ruby_2_7_4() {
         lineno_offset: 0,
         main_thread_offset,
         ec_offset: 32,
+        thread_ec_offset,
+        objspace_offset,
     };
 
     let yaml = serde_yaml::to_string(&ruby_2_7_4_offsets).unwrap();
@@ -294,6 +326,12 @@ fn dump_ruby_structs_ruby_2_7_6() {
     let main_thread_offset: i32 =
         offset_of!(rbspy_ruby_structs::ruby_2_7_6::rb_vm_struct, main_thread) as i32;
 
+    let thread_ec_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_7_6::rb_thread_struct, ec) as i32;
+
+    let objspace_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_2_7_6::rb_vm_struct, objspace) as i32;
+
     let ruby_2_7_6_offsets = RubyVersionOffsets {
         major_version: 2,
         minor_version: 7,
@@ -309,6 +347,8 @@ fn dump_ruby_structs_ruby_2_7_6() {
         lineno_offset: 0,
         main_thread_offset,
         ec_offset: 32,
+        thread_ec_offset,
+        objspace_offset,
     };
 
     let yaml = serde_yaml::to_string(&ruby_2_7_6_offsets).unwrap();
@@ -358,6 +398,12 @@ fn dump_ruby_structs_ruby_3_0_0() {
         main_thread
     ) as i32;
 
+    let thread_ec_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_3_0_0::rb_thread_struct, ec) as i32;
+
+    let objspace_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_3_0_0::rb_vm_struct, objspace) as i32;
+
     let ruby_3_0_0_offsets = RubyVersionOffsets {
         major_version: 3,
         minor_version: 0,
@@ -384,6 +430,8 @@ fn dump_ruby_structs_ruby_3_0_0() {
         // (gdb) p/d sizeof(struct rb_ractor_pub) + sizeof(struct rb_ractor_sync) + sizeof(VALUE) + sizeof(_Bool) + 7 + sizeof(rb_nativethread_cond_t) + sizeof(struct list_head) + sizeof(unsigned int) *3 + 4 + sizeof(rb_global_vm_lock_t)
         // $16 = 520
         ec_offset: 520,
+        thread_ec_offset,
+        objspace_offset,
     };
 
     let yaml = serde_yaml::to_string(&ruby_3_0_0_offsets).unwrap();
@@ -434,6 +482,12 @@ fn dump_ruby_structs_ruby_3_0_4() {
         main_thread
     ) as i32;
 
+    let thread_ec_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_3_0_4::rb_thread_struct, ec) as i32;
+
+    let objspace_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_3_0_4::rb_vm_struct, objspace) as i32;
+
     let ruby_3_0_4_offsets = RubyVersionOffsets {
         major_version: 3,
         minor_version: 0,
@@ -460,6 +514,8 @@ fn dump_ruby_structs_ruby_3_0_4() {
         // (gdb) p/d sizeof(struct rb_ractor_pub) + sizeof(struct rb_ractor_sync) + sizeof(VALUE) + sizeof(_Bool) + 7 + sizeof(rb_nativethread_cond_t) + sizeof(struct list_head) + sizeof(unsigned int) *3 + 4 + sizeof(rb_global_vm_lock_t)
         // $16 = 520
         ec_offset: 520,
+        thread_ec_offset,
+        objspace_offset,
     };
 
     let yaml = serde_yaml::to_string(&ruby_3_0_4_offsets).unwrap();
@@ -510,6 +566,12 @@ fn dump_ruby_structs_ruby_3_1_2() {
         main_thread
     ) as i32;
 
+    let thread_ec_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_3_1_2::rb_thread_struct, ec) as i32;
+
+    let objspace_offset: i32 =
+        offset_of!(rbspy_ruby_structs::ruby_3_1_2::rb_vm_struct, objspace) as i32;
+
     let ruby_3_1_2_offsets = RubyVersionOffsets {
         major_version: 3,
         minor_version: 1,
@@ -536,6 +598,8 @@ fn dump_ruby_structs_ruby_3_1_2() {
         // (gdb) p/d sizeof(struct rb_ractor_pub) + sizeof(struct rb_ractor_sync) + sizeof(VALUE) + sizeof(_Bool) + 7 + sizeof(rb_nativethread_cond_t) + sizeof(struct list_head) + sizeof(unsigned int) *3 + 4 + sizeof(rb_global_vm_lock_t)
         // $16 = 520
         ec_offset: 520,
+        thread_ec_offset,
+        objspace_offset,
     };
 
     let yaml = serde_yaml::to_string(&ruby_3_1_2_offsets).unwrap();
@@ -546,7 +610,10 @@ fn dump_ruby_structs_ruby_3_1_2() {
         .unwrap();
 }
 
-fn main() {
+mod bench_overhead;
+mod stress;
+
+fn dump_ruby_structs() {
     dump_ruby_structs_ruby_2_6_0();
     dump_ruby_structs_ruby_2_6_3();
 
@@ -558,3 +625,17 @@ fn main() {
     dump_ruby_structs_ruby_3_0_4();
     dump_ruby_structs_ruby_3_1_2();
 }
+
+fn main() {
+    let args: Vec<String> = std::env::args().skip(1).collect();
+    match args.first().map(String::as_str) {
+        // Without a task, regenerate the Ruby version offsets
+        None => dump_ruby_structs(),
+        Some("bench-overhead") => bench_overhead::run(&args[1..]),
+        Some("stress") => stress::run(&args[1..]),
+        Some(task) => {
+            eprintln!("unknown task {}, available: bench-overhead, stress", task);
+            std::process::exit(1);
+        }
+    }
+}
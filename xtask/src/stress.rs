@@ -0,0 +1,276 @@
+//! Finds the highest event rate rbperf sustains without losing events, for
+//! the perf and ring buffers at several sizes.
+//!
+//! A many-threaded Ruby program calls writev(2) at increasing rates while
+//! rbperf traces it, and the BPF and userspace counters in `Stats` tell how
+//! many events were seen and how many were lost.
+
+use std::fs;
+use std::io::{BufRead, BufReader};
+use std::path::PathBuf;
+use std::process::{Command, Stdio};
+use std::sync::atomic::AtomicBool;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use rbperf::profile::Profile;
+use rbperf::rbperf::{Rbperf, RbperfEvent, RbperfOptions, Stats, SyscallWeight};
+use serde::Serialize;
+
+const WRITEV_THREADS: &str = "tests/programs/writev_threads.rb";
+// Unlimited, as fast as the program can go.
+const MAX_RATE: u64 = 0;
+
+struct Options {
+    duration: Duration,
+    ruby: String,
+    threads: u32,
+    rates: Vec<u64>,
+    // Highest fraction of lost events that still counts as sustained.
+    max_loss_ratio: f64,
+    output: Option<PathBuf>,
+}
+
+impl Default for Options {
+    fn default() -> Self {
+        Options {
+            duration: Duration::from_secs(5),
+            ruby: "ruby".to_string(),
+            threads: 32,
+            rates: vec![
+                10_000, 50_000, 100_000, 250_000, 500_000, 1_000_000, MAX_RATE,
+            ],
+            max_loss_ratio: 0.001,
+            output: None,
+        }
+    }
+}
+
+const USAGE: &str = "cargo xtask stress [options]
+
+Options:
+    --duration <seconds>       how long to trace every rate for [5]
+    --ruby <path>              Ruby interpreter [ruby]
+    --threads <n>              threads calling writev [32]
+    --rates <r1,r2,...>        writev calls per second to try, 0 is unlimited
+                               [10000,50000,100000,250000,500000,1000000,0]
+    --max-loss-ratio <ratio>   lost events still considered sustained [0.001]
+    --output <path>            also write the results as JSON";
+
+fn parse_args(args: &[String]) -> Result<Options, String> {
+    let mut options = Options::default();
+    let mut args = args.iter();
+    while let Some(arg) = args.next() {
+        let mut value = || {
+            args.next()
+                .cloned()
+                .ok_or_else(|| format!("{} needs a value", arg))
+        };
+        match arg.as_str() {
+            "--duration" => {
+                let seconds = value()?.parse().map_err(|_| "invalid --duration")?;
+                options.duration = Duration::from_secs(seconds);
+            }
+            "--ruby" => options.ruby = value()?,
+            "--threads" => options.threads = value()?.parse().map_err(|_| "invalid --threads")?,
+            "--rates" => {
+                options.rates = value()?
+                    .split(',')
+                    .map(|rate| rate.parse())
+                    .collect::<Result<_, _>>()
+                    .map_err(|_| "invalid --rates")?;
+            }
+            "--max-loss-ratio" => {
+                options.max_loss_ratio = value()?.parse().map_err(|_| "invalid --max-loss-ratio")?
+            }
+            "--output" => options.output = Some(PathBuf::from(value()?)),
+            "--help" | "-h" => return Err(USAGE.to_string()),
+            other => return Err(format!("unknown option {}\n\n{}", other, USAGE)),
+        }
+    }
+    Ok(options)
+}
+
+#[derive(Clone, Copy, Debug, Serialize)]
+enum Buffer {
+    Perf { pages: usize },
+    Ring { size: u32 },
+}
+
+impl Buffer {
+    fn label(&self) -> String {
+        match self {
+            Buffer::Perf { pages } => format!("perf, {} pages/CPU", pages),
+            Buffer::Ring { size } => format!("ring, {} KB", size / 1024),
+        }
+    }
+}
+
+#[derive(Debug, Serialize)]
+struct Measurement {
+    buffer: Buffer,
+    // writev calls per second requested from the program, 0 is unlimited.
+    target_rate: u64,
+    // Events from the program BPF read a stack for, per second.
+    events_per_second: f64,
+    emitted_per_second: f64,
+    lost: u64,
+    loss_ratio: f64,
+}
+
+impl Measurement {
+    fn new(buffer: Buffer, target_rate: u64, stats: &Stats, elapsed: Duration) -> Self {
+        // A stack that doesn't fit in the buffer is counted by BPF, and the
+        // perf buffer also reports the same drop to userspace
+        let lost = stats.bpf_output_errors.max(stats.lost_event_errors);
+        let attempted = stats.bpf_samples_emitted + lost;
+        let seconds = elapsed.as_secs_f64();
+        Measurement {
+            buffer,
+            target_rate,
+            events_per_second: stats.bpf_samples_seen as f64 / seconds,
+            emitted_per_second: stats.bpf_samples_emitted as f64 / seconds,
+            lost,
+            loss_ratio: if attempted == 0 {
+                0.0
+            } else {
+                lost as f64 / attempted as f64
+            },
+        }
+    }
+}
+
+fn trace(options: &Options, buffer: Buffer, rate: u64) -> Measurement {
+    let mut program = Command::new(&options.ruby)
+        .args([
+            WRITEV_THREADS,
+            &options.threads.to_string(),
+            &rate.to_string(),
+        ])
+        .stdout(Stdio::piped())
+        .spawn()
+        .expect("failed to start the writev program");
+    let mut line = String::new();
+    BufReader::new(program.stdout.take().unwrap())
+        .read_line(&mut line)
+        .unwrap();
+    let pid: i32 = line
+        .trim()
+        .strip_prefix("PID: ")
+        .and_then(|pid| pid.parse().ok())
+        .unwrap_or_else(|| panic!("unexpected output from the program: {:?}", line));
+
+    let mut rbperf_options = RbperfOptions {
+        event: RbperfEvent::Syscall {
+            names: vec!["enter_writev".to_string()],
+            weight: SyscallWeight::Calls,
+        },
+        ..Default::default()
+    };
+    match buffer {
+        Buffer::Perf { pages } => rbperf_options.perf_buffer_pages = pages,
+        Buffer::Ring { size } => {
+            rbperf_options.use_ringbuf = true;
+            rbperf_options.ringbuf_size = size;
+        }
+    }
+    let mut rbperf = Rbperf::new(rbperf_options);
+    rbperf
+        .add_pid(pid)
+        .expect("failed to add the program's pid");
+
+    let started_at = Instant::now();
+    let mut profile = Profile::new();
+    let stats = rbperf
+        .start(
+            options.duration,
+            &mut profile,
+            Arc::new(AtomicBool::new(true)),
+        )
+        .expect("tracing failed, this needs to run as root");
+    let elapsed = started_at.elapsed();
+
+    program.kill().ok();
+    program.wait().ok();
+    Measurement::new(buffer, rate, &stats, elapsed)
+}
+
+fn rate_label(rate: u64) -> String {
+    if rate == MAX_RATE {
+        "max".to_string()
+    } else {
+        rate.to_string()
+    }
+}
+
+pub fn run(args: &[String]) {
+    let options = match parse_args(args) {
+        Ok(options) => options,
+        Err(message) => {
+            eprintln!("{}", message);
+            std::process::exit(1);
+        }
+    };
+
+    let buffers = [
+        Buffer::Perf { pages: 8 },
+        Buffer::Perf { pages: 64 },
+        Buffer::Perf { pages: 512 },
+        Buffer::Ring { size: 256 * 1024 },
+        Buffer::Ring {
+            size: 4 * 1024 * 1024,
+        },
+        Buffer::Ring {
+            size: 32 * 1024 * 1024,
+        },
+    ];
+
+    println!(
+        "{:<22} {:>10} {:>12} {:>12} {:>10} {:>8}",
+        "buffer", "rate", "events/s", "emitted/s", "lost", "loss"
+    );
+    let mut measurements = Vec::new();
+    let mut summary = Vec::new();
+    for buffer in buffers {
+        let mut sustained: Option<f64> = None;
+        for &rate in &options.rates {
+            let measurement = trace(&options, buffer, rate);
+            println!(
+                "{:<22} {:>10} {:>12.0} {:>12.0} {:>10} {:>7.3}%",
+                buffer.label(),
+                rate_label(rate),
+                measurement.events_per_second,
+                measurement.emitted_per_second,
+                measurement.lost,
+                measurement.loss_ratio * 100.0
+            );
+            let lossless = measurement.loss_ratio <= options.max_loss_ratio;
+            if lossless {
+                sustained = Some(sustained.unwrap_or(0.0).max(measurement.events_per_second));
+            }
+            measurements.push(measurement);
+            // Higher rates will only lose more
+            if !lossless {
+                break;
+            }
+        }
+        summary.push((buffer, sustained));
+    }
+
+    println!();
+    println!(
+        "Highest sustained rate with at most {:.2}% loss:",
+        options.max_loss_ratio * 100.0
+    );
+    for (buffer, sustained) in summary {
+        match sustained {
+            Some(rate) => println!("  {:<22} {:.0} events/s", buffer.label(), rate),
+            None => println!("  {:<22} none of the rates", buffer.label()),
+        }
+    }
+
+    if let Some(output) = &options.output {
+        fs::write(output, serde_json::to_string_pretty(&measurements).unwrap())
+            .expect("failed to write the results");
+    }
+}